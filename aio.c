@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "util.h"
+
+struct aio_stats aiostats;
+
+static enum aio_backend backend;
+static int chosen;
+
+static void finish(struct aio_req *req) {
+  aiostats.completed++;
+  aiostats.inflight--;
+  if (req->end) req->end(req);
+}
+
+static ssize_t do_io(struct aio_req *req) {
+  return req->write ? pwritev(req->dev, req->iov, req->iovcnt, req->off)
+                    : preadv(req->dev, req->iov, req->iovcnt, req->off);
+}
+
+// ---- io_uring, set up with the raw system calls ----
+
+static struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned queued;    // filled in but not yet handed to the kernel
+  unsigned inflight;  // handed to the kernel, not yet reaped
+} ring = {.fd = -1};
+
+static int uring_setup(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &p);
+  if (fd < 0) return -1;
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_len > sq_len) sq_len = cq_len;
+
+  uint8_t *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  uint8_t *cq = single || sq == MAP_FAILED
+                    ? sq
+                    : mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  ring.fd = fd;
+  ring.entries = p.sq_entries;
+  ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring.sqes = sqes;
+  return 0;
+}
+
+// hand the queued entries to the kernel, waiting for min_complete
+// completions as well; -1 if the ring has stopped working
+static int uring_enter(unsigned min_complete) {
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    int r = syscall(__NR_io_uring_enter, ring.fd, ring.queued, min_complete,
+                    flags, NULL, 0);
+    if (r >= 0) {
+      ring.queued -= r;
+      ring.inflight += r;
+      if (!ring.queued || min_complete) return 0;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return -1;
+    }
+  }
+}
+
+static void uring_queue(struct aio_req *req) {
+  unsigned tail = *ring.sq_tail, idx = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = req->dev;
+  sqe->off = req->off;
+  sqe->addr = (uintptr_t)req->iov;
+  sqe->len = req->iovcnt;
+  sqe->user_data = (uintptr_t)req;
+  ring.sq_array[idx] = idx;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+}
+
+// run the completions the kernel has posted
+static int uring_collect(void) {
+  unsigned head = *ring.cq_head, n = 0;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++, n++) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    struct aio_req *req = (struct aio_req *)(uintptr_t)cqe->user_data;
+    req->res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    ring.inflight--;
+    finish(req);
+  }
+  return n;
+}
+
+static int pool_setup(void);
+
+// the ring refused work: the entries the kernel hasn't taken are done here
+// and now, the ones it has are waited out, and later requests go to the
+// thread pool (or are done synchronously). Returns how many completed.
+static int uring_fail(void) {
+  err("io_uring failed, falling back");
+  unsigned tail = *ring.sq_tail, n = ring.queued;
+  __atomic_store_n(ring.sq_tail, tail - n, __ATOMIC_RELEASE);
+  ring.queued = 0;
+  for (unsigned i = tail - n; i != tail; i++) {
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sq_array[i & *ring.sq_mask]];
+    struct aio_req *req = (struct aio_req *)(uintptr_t)sqe->user_data;
+    req->res = do_io(req);
+    finish(req);
+  }
+
+  while (ring.inflight) {
+    n += uring_collect();
+    if (ring.inflight) usleep(100);
+  }
+  backend = pool_setup() == 0 ? AIO_POOL : AIO_SYNC;
+  return n;
+}
+
+static int uring_reap(int wait) {
+  if ((ring.queued || wait) && uring_enter(wait ? 1 : 0) == -1) {
+    return uring_fail();
+  }
+  return uring_collect();
+}
+
+// ---- a pool of threads doing plain preadv/pwritev ----
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static struct aio_req *work_head, *work_tail, *done_list;
+static int nworkers;
+
+static void *worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (!work_head) pthread_cond_wait(&work_cv, &pool_lock);
+    struct aio_req *req = work_head;
+    if (!(work_head = req->next)) work_tail = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    req->res = do_io(req);
+
+    pthread_mutex_lock(&pool_lock);
+    req->next = done_list;
+    done_list = req;
+    pthread_cond_signal(&done_cv);
+  }
+  return NULL;
+}
+
+static int pool_setup(void) {
+  while (nworkers < AIO_THREADS) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, NULL) != 0) break;
+    pthread_detach(t);
+    nworkers++;
+  }
+  return nworkers ? 0 : -1;
+}
+
+static void pool_queue(struct aio_req *req) {
+  req->next = NULL;
+  pthread_mutex_lock(&pool_lock);
+  if (work_tail) work_tail->next = req;
+  else work_head = req;
+  work_tail = req;
+  pthread_cond_signal(&work_cv);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static int pool_reap(int wait) {
+  pthread_mutex_lock(&pool_lock);
+  while (wait && !done_list) pthread_cond_wait(&done_cv, &pool_lock);
+  struct aio_req *list = done_list;
+  done_list = NULL;
+  pthread_mutex_unlock(&pool_lock);
+
+  int n = 0;
+  for (struct aio_req *next; list; list = next, n++) {
+    next = list->next;
+    finish(list);
+  }
+  return n;
+}
+
+// ---- the interface ----
+
+static void choose(void) {
+  if (chosen) return;
+  chosen = 1;
+  backend = uring_setup() == 0 ? AIO_URING
+            : pool_setup() == 0 ? AIO_POOL
+                                : AIO_SYNC;
+}
+
+// switch backends once everything in flight is done; -1 if it can't be
+// had here
+int aio_set_backend(enum aio_backend b) {
+  choose();
+  aio_drain();
+  if (b == AIO_URING && ring.fd == -1 && uring_setup() == -1) return -1;
+  if (b == AIO_POOL && pool_setup() == -1) return -1;
+  backend = b;
+  return 0;
+}
+
+enum aio_backend aio_get_backend(void) {
+  choose();
+  return backend;
+}
+
+const char *aio_backend_name(enum aio_backend b) {
+  return b == AIO_URING ? "io_uring" : b == AIO_POOL ? "threads" : "sync";
+}
+
+// start req; it may only be queued until aio_kick or the next reap
+void aio_submit(struct aio_req *req) {
+  choose();
+  while (aiostats.inflight >= AIO_DEPTH) aio_reap(1);
+
+  aiostats.submitted++;
+  if (++aiostats.inflight > aiostats.max_inflight) {
+    aiostats.max_inflight = aiostats.inflight;
+  }
+  if (backend == AIO_URING) {
+    uring_queue(req);
+  } else if (backend == AIO_POOL) {
+    pool_queue(req);
+  } else {
+    req->res = do_io(req);
+    finish(req);
+  }
+}
+
+// send whatever aio_submit has queued to the kernel
+void aio_kick(void) {
+  if (backend == AIO_URING && ring.queued && uring_enter(0) == -1) {
+    uring_fail();
+  }
+}
+
+// run the completions that are in, or wait for at least one if asked to
+// and something is in flight. Returns how many completed.
+int aio_reap(int wait) {
+  if (aiostats.inflight == 0) return 0;
+  if (wait) aiostats.waits++;
+  return backend == AIO_URING ? uring_reap(wait)
+         : backend == AIO_POOL ? pool_reap(wait)
+                               : 0;
+}
+
+void aio_drain(void) {
+  while (aiostats.inflight) aio_reap(1);
+}
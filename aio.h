@@ -0,0 +1,41 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AIO_DEPTH 256   // most requests in flight at once
+#define AIO_THREADS 4   // workers of the thread pool backend
+
+enum aio_backend { AIO_SYNC, AIO_POOL, AIO_URING };
+
+// one preadv or pwritev; end is called on the shell's thread when it is
+// done, from aio_reap (or from aio_submit with the sync backend)
+struct aio_req {
+  int dev, write;
+  off_t off;
+  struct iovec *iov;
+  int iovcnt;
+  ssize_t res;
+  void (*end)(struct aio_req *req);
+  struct aio_req *next;  // on the pool's queues
+};
+
+struct aio_stats {
+  unsigned long submitted, completed, waits;
+  int inflight, max_inflight;
+};
+
+extern struct aio_stats aiostats;
+
+// io_uring when the kernel has it, the thread pool otherwise
+int aio_set_backend(enum aio_backend backend);
+enum aio_backend aio_get_backend(void);
+const char *aio_backend_name(enum aio_backend backend);
+
+void aio_submit(struct aio_req *req);
+void aio_kick(void);
+int aio_reap(int wait);
+void aio_drain(void);
+
+#endif
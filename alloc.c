@@ -1,178 +1,474 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "alloc.h"
+#include "cache.h"
 #include "mount.h"
 #include "type.h"
 #include "util.h"
 
-int tst_bit(char *buf, int bit) {
-  int i, j;
+#define BITMAP_WORDS (BLKSIZE / sizeof(uint64_t))
+#define RESERVED_INO_BITS 11
+
+// load a bitmap block, bits past nbits are padding and read as in use
+static void bitmap_load(int dev, struct bitmap *bm, uint32_t blk,
+                        uint32_t nbits) {
+  bm->words = malloc(BLKSIZE);
+  get_block_buf(dev, blk, bm->words);
 
-  i = bit / 8;
-  j = bit % 8;
-  if (buf[i] & (1 << j)) {
-    return 1;
+  for (uint32_t i = nbits; i < BITMAP_WORDS * 64; i++) {
+    bm->words[i / 64] |= 1ULL << (i % 64);
   }
-  return 0;
+
+  bm->nbits = nbits;
+  bm->hint = 0;
+  bm->blk = blk;
+  bm->dirty = 0;
 }
 
-void clr_bit(char *buf, int bit) {
-  int i, j;
-  i = bit / 8;
-  j = bit % 8;
-  buf[i] &= ~(1 << j);
+static void bitmap_store(int dev, struct bitmap *bm) {
+  if (!bm->dirty) return;
+  put_block(dev, bm->blk, (char *)bm->words);
+  bm->dirty = 0;
 }
 
-int set_bit(char *buf, int bit) {
-  int i, j;
-  i = bit / 8;
-  j = bit % 8;
-  buf[i] |= (1 << j);
-  return 0;
+// claim the first zero bit, returns -1 when the map is full
+int bitmap_alloc(struct bitmap *bm) {
+  for (uint32_t w = bm->hint; w < BITMAP_WORDS; w++) {
+    if (bm->words[w] != ~0ULL) {
+      int bit = w * 64 + __builtin_ctzll(~bm->words[w]);
+      bm->words[w] |= 1ULL << (bit % 64);
+      bm->hint = w;
+      bm->dirty = 1;
+      return bit;
+    }
+  }
+  bm->hint = BITMAP_WORDS;
+  return -1;
+}
+
+// claim the first zero bit at or after goal, else the first one overall
+int bitmap_alloc_near(struct bitmap *bm, uint32_t goal) {
+  if (goal >= bm->nbits) return bitmap_alloc(bm);
+
+  uint32_t w = goal / 64;
+  uint64_t used = bm->words[w] | ((1ULL << (goal % 64)) - 1);
+  for (;;) {
+    if (used != ~0ULL) {
+      int bit = w * 64 + __builtin_ctzll(~used);
+      bm->words[w] |= 1ULL << (bit % 64);
+      bm->dirty = 1;
+      return bit;
+    }
+    if (++w == BITMAP_WORDS) break;
+    used = bm->words[w];
+  }
+  return bitmap_alloc(bm);
 }
 
-int incFreeInodes(int dev) {
-  char buf[BLKSIZE];
+// next bit at or after from with the given value, nbits if there is none
+static uint32_t bitmap_next(struct bitmap *bm, uint32_t from, int value) {
+  if (from >= bm->nbits) return bm->nbits;
 
-  // inc free inodes count in SUPER and GD
-  get_block_buf(dev, 1, buf);
-  sp = (SUPER *)buf;
-  sp->s_free_inodes_count++;
-  put_block(dev, 1, buf);
+  uint32_t w = from / 64;
+  uint64_t word = value ? bm->words[w] : ~bm->words[w];
+  word &= ~0ULL << (from % 64);
+  while (!word) {
+    if (++w == BITMAP_WORDS) return bm->nbits;
+    word = value ? bm->words[w] : ~bm->words[w];
+  }
 
-  get_block_buf(dev, 2, buf);
-  gp = (GD *)buf;
-  gp->bg_free_inodes_count++;
-  put_block(dev, 2, buf);
+  uint32_t bit = w * 64 + __builtin_ctzll(word);
+  return bit < bm->nbits ? bit : bm->nbits;
+}
 
-  return 0;
+// claim the first run of at least min (up to want) zero bits at or after
+// goal, returns its first bit and length in *got, or -1 if there is none
+int bitmap_alloc_range(struct bitmap *bm, uint32_t goal, int want, int min,
+                       int *got) {
+  uint32_t start = bitmap_next(bm, goal, 0);
+
+  while (start < bm->nbits) {
+    uint32_t end = bitmap_next(bm, start, 1);
+    if ((int)(end - start) >= min) {
+      int n = end - start < (uint32_t)want ? (int)(end - start) : want;
+      for (int i = 0; i < n; i++) {
+        bm->words[(start + i) / 64] |= 1ULL << ((start + i) % 64);
+      }
+      bm->dirty = 1;
+      *got = n;
+      return start;
+    }
+    start = bitmap_next(bm, end, 0);
+  }
+  return -1;
+}
+
+void bitmap_free(struct bitmap *bm, uint32_t bit) {
+  if (bit >= bm->nbits) return;
+  bm->words[bit / 64] &= ~(1ULL << (bit % 64));
+  if (bit / 64 < bm->hint) bm->hint = bit / 64;
+  bm->dirty = 1;
+}
+
+// clear bits [bit, bit + n), a whole word at a time where it can
+static void bitmap_free_range(struct bitmap *bm, uint32_t bit, uint32_t n) {
+  if (bit >= bm->nbits) return;
+  if (n > bm->nbits - bit) n = bm->nbits - bit;
+  if (bit / 64 < bm->hint) bm->hint = bit / 64;
+
+  for (uint32_t end = bit + n; bit < end;) {
+    uint32_t k = 64 - bit % 64 < end - bit ? 64 - bit % 64 : end - bit;
+    uint64_t mask = k == 64 ? ~0ULL : ((1ULL << k) - 1) << (bit % 64);
+    bm->words[bit / 64] &= ~mask;
+    bit += k;
+  }
+  bm->dirty = 1;
+}
+
+// group helpers, block bitmap bit n of group g tracks block
+// first_data_block + g * blocks_per_group + n
+int ino_group(struct mntable *me, int ino) {
+  return (ino - 1) / me->inodes_per_group;
+}
+
+int blk_group(struct mntable *me, int blk) {
+  return (blk - me->first_data_block) / me->blocks_per_group;
+}
+
+static int group_first_blk(struct mntable *me, int g) {
+  return me->first_data_block + g * me->blocks_per_group;
+}
+
+// copy the in-core SUPER and GDs back into block 1 and the descriptor table
+void super_sync(struct mntable *me) {
+  me->super_synced = time(0);
+  if (!me->super_dirty) return;
+
+  me->super.s_wtime = me->super_synced;
+  put_block(me->dev, 1, (char *)&me->super);
+
+  uint32_t gd_bytes = me->ngroups * sizeof(GD);
+  for (uint32_t off = 0; off < gd_bytes; off += BLKSIZE) {
+    uint32_t n = gd_bytes - off;
+    struct buf *bp = bread(me->dev, me->first_data_block + 1 + off / BLKSIZE);
+    memcpy(bp->data, (uint8_t *)me->gd + off, n < BLKSIZE ? n : BLKSIZE);
+    bdirty(bp);
+    brelse(bp);
+  }
+
+  me->super_dirty = 0;
+  me->super_writes++;
+}
+
+void alloc_init(struct mntable *me) {
+  get_block_buf(me->dev, 1, &me->super);
+  me->super_dirty = 0;
+  me->super_synced = time(0);
+
+  me->first_data_block = me->super.s_first_data_block;
+  me->blocks_per_group = me->super.s_blocks_per_group;
+  me->inodes_per_group = me->super.s_inodes_per_group;
+  me->inode_size = me->super.s_rev_level ? me->super.s_inode_size : 128;
+  me->ngroups = (me->nblocks - me->first_data_block + me->blocks_per_group - 1) /
+                me->blocks_per_group;
+
+  // the descriptor table starts in the block after the superblock
+  uint32_t gd_bytes = me->ngroups * sizeof(GD);
+  me->gd = malloc(gd_bytes);
+  for (uint32_t off = 0; off < gd_bytes; off += BLKSIZE) {
+    uint32_t n = gd_bytes - off;
+    uint8_t *blk = get_block(me->dev, me->first_data_block + 1 + off / BLKSIZE);
+    memcpy((uint8_t *)me->gd + off, blk, n < BLKSIZE ? n : BLKSIZE);
+  }
+
+  me->block_maps = calloc(me->ngroups, sizeof(struct bitmap));
+  me->inode_maps = calloc(me->ngroups, sizeof(struct bitmap));
+  for (int g = 0; g < me->ngroups; g++) {
+    uint32_t nblks = me->nblocks - group_first_blk(me, g);
+    if (nblks > me->blocks_per_group) nblks = me->blocks_per_group;
+
+    bitmap_load(me->dev, &me->block_maps[g], me->gd[g].bg_block_bitmap, nblks);
+    bitmap_load(me->dev, &me->inode_maps[g], me->gd[g].bg_inode_bitmap,
+                me->inodes_per_group);
+  }
+
+  // the first inodes are reserved, never hand them out
+  me->inode_maps[0].words[0] |= (1ULL << RESERVED_INO_BITS) - 1;
 }
 
-int decFreeInodes(int dev) {
-  char buf[BLKSIZE];
+// write dirty counters and bitmaps back to the block cache
+void alloc_sync(struct mntable *me) {
+  super_sync(me);
+  for (int g = 0; g < me->ngroups; g++) {
+    bitmap_store(me->dev, &me->block_maps[g]);
+    bitmap_store(me->dev, &me->inode_maps[g]);
+  }
+}
+
+void alloc_release(struct mntable *me) {
+  for (int g = 0; g < me->ngroups; g++) {
+    free(me->block_maps[g].words);
+    free(me->inode_maps[g].words);
+  }
+  free(me->block_maps);
+  free(me->inode_maps);
+  free(me->gd);
+  me->block_maps = me->inode_maps = NULL;
+  me->gd = NULL;
+}
+
+// counters live in the mount table entry and are written back lazily
+static void counters_changed(struct mntable *me) {
+  me->super_dirty = 1;
+  if (time(0) - me->super_synced >= SUPER_SYNC_SECS) super_sync(me);
+}
+
+int incFreeInodes(int dev, int group) {
+  struct mntable *me = dev_to_mnt_entry(dev);
 
   // inc free inodes count in SUPER and GD
-  get_block_buf(dev, 1, buf);
-  sp = (SUPER *)buf;
-  sp->s_free_inodes_count--;
-  put_block(dev, 1, buf);
+  me->super.s_free_inodes_count++;
+  me->gd[group].bg_free_inodes_count++;
+  counters_changed(me);
+
+  return 0;
+}
 
-  get_block_buf(dev, 2, buf);
-  gp = (GD *)buf;
-  gp->bg_free_inodes_count--;
-  put_block(dev, 2, buf);
+int decFreeInodes(int dev, int group) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+
+  me->super.s_free_inodes_count--;
+  me->gd[group].bg_free_inodes_count--;
+  counters_changed(me);
 
   return 0;
 }
 
-int incFreeBlocks(int dev) {
-  char buf[BLKSIZE];
+int incFreeBlocks(int dev, int group) {
+  struct mntable *me = dev_to_mnt_entry(dev);
 
   // inc free block count in SUPER and GD
-  get_block_buf(dev, 1, buf);
-  sp = (SUPER *)buf;
-  sp->s_free_blocks_count++;
-  put_block(dev, 1, buf);
-
-  get_block_buf(dev, 2, buf);
-  gp = (GD *)buf;
-  gp->bg_free_blocks_count++;
-  put_block(dev, 2, buf);
+  me->super.s_free_blocks_count++;
+  me->gd[group].bg_free_blocks_count++;
+  counters_changed(me);
 
   return 0;
 }
 
-int decFreeBlocks(int dev) {
-  char buf[BLKSIZE];
+int decFreeBlocks(int dev, int group) {
+  struct mntable *me = dev_to_mnt_entry(dev);
 
-  get_block_buf(dev, 1, buf);
-  sp = (SUPER *)buf;
-  sp->s_free_blocks_count--;
-  put_block(dev, 1, buf);
+  me->super.s_free_blocks_count--;
+  me->gd[group].bg_free_blocks_count--;
+  counters_changed(me);
 
-  get_block_buf(dev, 2, buf);
-  gp = (GD *)buf;
-  gp->bg_free_blocks_count--;
-  put_block(dev, 2, buf);
+  return 0;
+}
 
+int incUsedDirs(int dev, int ino) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+  me->gd[ino_group(me, ino)].bg_used_dirs_count++;
+  counters_changed(me);
   return 0;
 }
 
-#define RESERVED_INO_BITS 11
+int decUsedDirs(int dev, int ino) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+  me->gd[ino_group(me, ino)].bg_used_dirs_count--;
+  counters_changed(me);
+  return 0;
+}
+
+// new directories go to a group with an above average share of free
+// inodes, picking the one with the most free blocks to spread them out
+static int find_group_dir(struct mntable *me) {
+  uint32_t avg_free_inodes = me->super.s_free_inodes_count / me->ngroups;
+  int best = -1;
+
+  for (int g = 0; g < me->ngroups; g++) {
+    GD *gd = &me->gd[g];
+    if (gd->bg_free_inodes_count == 0 ||
+        gd->bg_free_inodes_count < avg_free_inodes) {
+      continue;
+    }
+    if (best == -1 ||
+        gd->bg_free_blocks_count > me->gd[best].bg_free_blocks_count) {
+      best = g;
+    }
+  }
+  return best;
+}
 
-int ialloc(int dev) {
-  int i;
-  char buf[BLKSIZE] = {0};
+// everything else stays in the parent's group if it has room, otherwise
+// probe quadratically for a group with free inodes and blocks, then linearly
+static int find_group_other(struct mntable *me, int parent_group) {
+  int n = me->ngroups, g = parent_group;
 
+  if (me->gd[g].bg_free_inodes_count && me->gd[g].bg_free_blocks_count) {
+    return g;
+  }
+
+  for (int i = 1; i < n; i <<= 1) {
+    g = (g + i) % n;
+    if (me->gd[g].bg_free_inodes_count && me->gd[g].bg_free_blocks_count) {
+      return g;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    g = (parent_group + i) % n;
+    if (me->gd[g].bg_free_inodes_count) return g;
+  }
+  return -1;
+}
+
+int ialloc(int dev, int parent_ino, int is_dir) {
   struct mntable *me = dev_to_mnt_entry(dev);
+  int parent_group = parent_ino ? ino_group(me, parent_ino) : 0;
 
-  // get inode Bitmap into buf
-  get_block_buf(dev, me->imap, buf);
+  int g = is_dir ? find_group_dir(me) : find_group_other(me, parent_group);
+  if (g == -1) g = find_group_other(me, parent_group);
+  if (g == -1) return 0;
 
-  for (i = RESERVED_INO_BITS; i < me->ninodes + RESERVED_INO_BITS; i++) {
-    if (tst_bit(buf, i) == 0) {
-      set_bit(buf, i);
-      put_block(dev, me->imap, buf);
+  for (int i = 0; i < me->ngroups; i++, g = (g + 1) % me->ngroups) {
+    int bit = bitmap_alloc(&me->inode_maps[g]);
+    if (bit == -1) continue;
 
-      // update free inode count in SUPER and GD
-      decFreeInodes(dev);
+    // update free inode count in SUPER and GD
+    decFreeInodes(dev, g);
 
-      //   printf("ialloc: ino=%d\n", i + 1);
-      return (i + 1);
-    }
+    return g * me->inodes_per_group + bit + 1;
   }
   return 0;
 }
 
 void idealloc(int dev, int ino) {
-  char buf[BLKSIZE];
-
   struct mntable *me = dev_to_mnt_entry(dev);
 
-  if (ino > me->ninodes) {
+  if (ino <= RESERVED_INO_BITS || ino > me->ninodes) {
     // printf("inumber %d out of range\n", ino);
     return;
   }
 
-  // get inode bitmap block
-  get_block_buf(dev, me->imap, buf);
-  clr_bit(buf, ino - 1);
-
-  // write buf back
-  put_block(dev, me->imap, buf);
+  int g = ino_group(me, ino);
+  bitmap_free(&me->inode_maps[g], (ino - 1) % me->inodes_per_group);
 
   // update free inode count in SUPER and GD
-  incFreeInodes(dev);
+  incFreeInodes(dev, g);
 }
 
-int balloc(int dev) {
-  int i;
-  char buf[BLKSIZE];
+// first block of the group holding ino, the allocation goal for its data
+int ino_goal(int dev, int ino) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+  return group_first_blk(me, ino_group(me, ino));
+}
 
+// free blocks that are not promised to delayed pages (or to the indirect
+// blocks those will need)
+uint32_t blocks_available(struct mntable *me) {
+  uint32_t free = me->super.s_free_blocks_count;
+  return free > me->dalloc_reserved ? free - me->dalloc_reserved : 0;
+}
+
+// allocate the free block closest after goal, moving on through the groups
+// (goal 0 means no preference)
+int balloc(int dev, int goal) {
   struct mntable *me = dev_to_mnt_entry(dev);
+  if (blocks_available(me) == 0) return 0;
 
-  get_block_buf(dev, me->bmap, buf);
+  if (goal < (int)me->first_data_block || goal >= me->nblocks) {
+    goal = me->first_data_block;
+  }
+  int g = blk_group(me, goal);
+
+  for (int i = 0; i < me->ngroups; i++, g = (g + 1) % me->ngroups) {
+    int bit = i == 0 ? bitmap_alloc_near(&me->block_maps[g],
+                                         goal - group_first_blk(me, g))
+                     : bitmap_alloc(&me->block_maps[g]);
+    if (bit == -1) continue;
+
+    // update free block count in SUPER and GD
+    decFreeBlocks(dev, g);
+
+    return group_first_blk(me, g) + bit;
+  }
+  return 0;
+}
 
-  for (i = 0; i < me->nblocks; i++) {
-    if (tst_bit(buf, i) == 0) {
-      set_bit(buf, i);
-      put_block(dev, me->bmap, buf);
+// allocate up to want contiguous blocks as close after goal as possible,
+// returning the first block and the run length in *got (0 when full).
+// A full length run anywhere beats a shorter one near the goal.
+int balloc_range(int dev, int goal, int want, int *got) {
+  struct mntable *me = dev_to_mnt_entry(dev);
 
-      // update free inode count in SUPER and GD
-      decFreeInodes(dev);
+  if (goal < (int)me->first_data_block || goal >= me->nblocks) {
+    goal = me->first_data_block;
+  }
+  // no free run is longer than the most free blocks any group has
+  uint32_t most = 0;
+  for (int g = 0; g < me->ngroups; g++) {
+    if (me->gd[g].bg_free_blocks_count > most) {
+      most = me->gd[g].bg_free_blocks_count;
+    }
+  }
+  if (want > (int)most) want = most;
+  if (want > (int)blocks_available(me)) want = blocks_available(me);
+  if (want == 0) {
+    *got = 0;
+    return 0;
+  }
 
-      //   printf("ialloc: ino=%d\n", i + 1);
-      return (i + 1);
+  for (int min = want;; min = 1) {
+    int g = blk_group(me, goal);
+    for (int i = 0; i < me->ngroups; i++, g = (g + 1) % me->ngroups) {
+      if ((int)me->gd[g].bg_free_blocks_count < min) continue;
+      uint32_t from = i == 0 ? goal - group_first_blk(me, g) : 0;
+      int bit = bitmap_alloc_range(&me->block_maps[g], from, want, min, got);
+      if (bit == -1 && i == 0 && from) {
+        bit = bitmap_alloc_range(&me->block_maps[g], 0, want, min, got);
+      }
+      if (bit == -1) continue;
+
+      me->super.s_free_blocks_count -= *got;
+      me->gd[g].bg_free_blocks_count -= *got;
+      counters_changed(me);
+      return group_first_blk(me, g) + bit;
     }
+    if (min == 1) break;
   }
+
+  *got = 0;
   return 0;
 }
 
-int bdealloc(int dev, int bit) {
-  char buf[BLKSIZE];
+// free n blocks at once, a contiguous range of bits and one counter update
+// per run of consecutive block numbers in the list, which should be sorted
+void bdealloc_list(int dev, const uint32_t *blks, int n) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+
+  for (int i = 0, j; i < n; i = j) {
+    int g = blk_group(me, blks[i]);
+    uint32_t first = group_first_blk(me, g);
+    uint32_t end = first + me->blocks_per_group;
+
+    for (j = i + 1; j < n && blks[j] == blks[j - 1] + 1 && blks[j] < end; j++)
+      ;
+    bitmap_free_range(&me->block_maps[g], blks[i] - first, j - i);
+    me->super.s_free_blocks_count += j - i;
+    me->gd[g].bg_free_blocks_count += j - i;
+  }
+  if (n) counters_changed(me);
+}
+
+int bdealloc(int dev, int blk) {
+  if (blk == 0) return 0;
 
   struct mntable *me = dev_to_mnt_entry(dev);
-  get_block_buf(dev, me->bmap, buf);
-  clr_bit(buf, bit);
-  put_block(dev, me->bmap, buf);
+  int g = blk_group(me, blk);
+  bitmap_free(&me->block_maps[g], blk - group_first_blk(me, g));
+  incFreeBlocks(dev, g);
 
   return 0;
-}
\ No newline at end of file
+}
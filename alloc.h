@@ -1,12 +1,35 @@
 #ifndef ALLOC_H
 #define ALLOC_H
 
-int ialloc(int dev);
-int decFreeInodes(int dev);
-int incFreeBlocks(int dev);
-int decFreeBlocks(int dev);
+#include "type.h"
+
+int ialloc(int dev, int parent_ino, int is_dir);
+int incFreeInodes(int dev, int group);
+int decFreeInodes(int dev, int group);
+int incFreeBlocks(int dev, int group);
+int decFreeBlocks(int dev, int group);
+int incUsedDirs(int dev, int ino);
+int decUsedDirs(int dev, int ino);
 void idealloc(int dev, int ino);
-int balloc(int dev);
-int bdealloc(int dev, int bit);
+uint32_t blocks_available(struct mntable *me);
+int balloc(int dev, int goal);
+int balloc_range(int dev, int goal, int want, int *got);
+int bdealloc(int dev, int blk);
+void bdealloc_list(int dev, const uint32_t *blks, int n);
+
+int ino_group(struct mntable *me, int ino);
+int blk_group(struct mntable *me, int blk);
+int ino_goal(int dev, int ino);
+
+void alloc_init(struct mntable *me);
+void alloc_sync(struct mntable *me);
+void super_sync(struct mntable *me);
+void alloc_release(struct mntable *me);
+
+int bitmap_alloc(struct bitmap *bm);
+int bitmap_alloc_near(struct bitmap *bm, uint32_t goal);
+int bitmap_alloc_range(struct bitmap *bm, uint32_t goal, int want, int min,
+                       int *got);
+void bitmap_free(struct bitmap *bm, uint32_t bit);
 
 #endif
\ No newline at end of file
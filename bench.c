@@ -0,0 +1,695 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "alloc.h"
+#include "bench.h"
+#include "cache.h"
+#include "dir.h"
+#include "fileio.h"
+#include "fileops.h"
+#include "journal.h"
+#include "mount.h"
+#include "orphan.h"
+#include "type.h"
+#include "util.h"
+
+extern PROC *running;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long ops, double secs) {
+  printf("%s: %ld ops in %.3f ms (%.0f ops/s)\n", name, ops, secs * 1e3,
+         secs > 0 ? ops / secs : 0.0);
+}
+
+// allocate and free n blocks in the first group of the cwd filesystem, in rounds
+// of as many as fit, leaving the bitmap as it was found
+static void bench_alloc(int n) {
+  struct bitmap *bm = &dev_to_mnt_entry(running->cwd->dev)->block_maps[0];
+  int *bits = malloc(bm->nbits * sizeof(int));
+  long done = 0;
+
+  double start = now();
+  while (done < n) {
+    int k = 0;
+    while (done < n && (bits[k] = bitmap_alloc(bm)) != -1) {
+      k++;
+      done++;
+    }
+    if (k == 0) break;
+
+    for (int i = 0; i < k; i++) bitmap_free(bm, bits[i]);
+  }
+  report("alloc+free", done, now() - start);
+
+  free(bits);
+}
+
+// read every block of the cwd image through the cache, first with pread and
+// then out of a mapping; the mount is left in the mode it started in
+static void bench_mmap(int passes) {
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  int was_mapped = bmapped(me->dev);
+  volatile uint8_t sink = 0;
+
+  for (int mapped = 0; mapped < 2; mapped++) {
+    bflush(me->dev);
+    binval(me->dev);
+    if (mapped && bmmap(me->dev) == -1) {
+      err("cannot mmap image");
+      break;
+    }
+
+    double start = now();
+    for (int p = 0; p < passes; p++) {
+      for (int blk = 0; blk < me->nblocks; blk++) {
+        struct buf *bp = bread(me->dev, blk);
+        sink ^= bp->data[blk % BLKSIZE];
+        brelse(bp);
+      }
+    }
+    report(mapped ? "mmap read" : "pread read", (long)passes * me->nblocks,
+           now() - start);
+  }
+
+  bflush(me->dev);
+  binval(me->dev);
+  if (was_mapped) bmmap(me->dev);
+}
+
+// fill a fresh directory under cwd with n entries (all naming the directory
+// itself, so no inodes are used), list it, look up names spread across it,
+// then remove it again
+static void bench_dir(int n) {
+  MINODE *pmip = running->cwd;
+  int dev = pmip->dev;
+  char name[32];
+
+  if (search_dir("bench.dir", 9, pmip->ino, &dev)) {
+    err("bench.dir already exists");
+    return;
+  }
+  kmkdir(pmip, "bench.dir");
+  MINODE *dmip = iget(dev, search_dir("bench.dir", 9, pmip->ino, &dev));
+
+  int made = 0;
+  double start = now();
+  for (; made < n; made++) {
+    sprintf(name, "entry%07d", made);
+    if (!enter_child(dmip, dmip->ino, name, EXT2_FT_REG_FILE)) break;
+  }
+  report("dir create", made, now() - start);
+
+  struct dir_iter it;
+  long listed = 0;
+  start = now();
+  dir_iter_start(&it, dmip);
+  while (dir_iter_next(&it)) listed++;
+  report("dir list", listed, now() - start);
+
+  int lookups = made < 1000 ? made : 1000, found = 0;
+  start = now();
+  for (int i = 0; i < lookups; i++) {
+    sprintf(name, "entry%07d", (int)((long)i * made / lookups));
+    found += search_dir(name, strlen(name), dmip->ino, &dev) ==
+             (uint32_t)dmip->ino;
+  }
+  report("dir lookup", lookups, now() - start);
+
+  if (listed != made + 2 || found != lookups) err("directory lost entries");
+  printf("%d blocks\n", dmip->INODE.i_size / BLKSIZE);
+
+  krmdir(pmip, dmip, "bench.dir");
+  iput(dmip);
+}
+
+// build a chain of depth directories under cwd and resolve the full path to
+// the bottom of it repeatedly, then take the chain down again
+static void bench_path(int depth) {
+  MINODE *pmip = running->cwd;
+  int dev = pmip->dev;
+
+  if (search_dir("bench.path", 10, pmip->ino, &dev)) {
+    err("bench.path already exists");
+    return;
+  }
+
+  // every level needs an inode and a block
+  struct mntable *me = dev_to_mnt_entry(dev);
+  if ((uint32_t)depth >= me->super.s_free_inodes_count ||
+      (uint32_t)depth >= me->super.s_free_blocks_count) {
+    err("not enough free inodes or blocks for that depth");
+    return;
+  }
+
+  MINODE **dirs = malloc((depth + 1) * sizeof(*dirs));
+  char *path = malloc(10 + 2 * depth + 1), *end = path;
+  end += sprintf(end, "bench.path");
+
+  kmkdir(pmip, "bench.path");
+  dirs[0] = iget(dev, search_dir("bench.path", 10, pmip->ino, &dev));
+  for (int i = 1; i <= depth; i++) {
+    kmkdir(dirs[i - 1], "d");
+    dirs[i] = iget(dev, search_dir("d", 1, dirs[i - 1]->ino, &dev));
+    end += sprintf(end, "/d");
+  }
+
+  int lookups = 100000, found = 0;
+  double start = now();
+  for (int i = 0; i < lookups; i++) {
+    int d;
+    found += getino(&d, path) == dirs[depth]->ino;
+  }
+  char name[64];
+  sprintf(name, "path lookup, depth %d", depth);
+  report(name, lookups, now() - start);
+  if (found != lookups) err("path lookup failed");
+
+  for (int i = depth; i > 0; i--) {
+    krmdir(dirs[i - 1], dirs[i], "d");
+    iput(dirs[i]);
+  }
+  krmdir(pmip, dirs[0], "bench.path");
+  iput(dirs[0]);
+  free(path);
+  free(dirs);
+}
+
+// read a file from cold through loc_read, in 64 KiB and then in 1 KiB
+// calls, then the same number of bytes straight from the image file
+static void bench_read(char *path) {
+  static char buf[64 * BLKSIZE];
+  long bytes = 0;
+  int dev = 0;
+  size_t n;
+
+  for (int chunk = sizeof(buf); chunk >= BLKSIZE; chunk /= 64) {
+    int fd = loc_open(path, R);
+    if (fd == -1) {
+      err("cannot open file");
+      return;
+    }
+
+    dev = running->fd[fd]->mptr->dev;
+    int was_mapped = bmapped(dev);
+    bflush(dev);
+    binval(dev);
+    if (was_mapped) bmmap(dev);
+
+    unsigned long reads = bstats.reads, ra_hits = bstats.ra_hits;
+    bytes = 0;
+    double start = now();
+    while ((n = loc_read(fd, buf, chunk)) > 0) bytes += n;
+    double secs = now() - start;
+    loc_close(fd);
+    printf("read %d KiB at a time: %ld bytes in %.3f ms (%.1f MB/s), "
+           "%lu device reads, %lu readahead hits\n",
+           chunk / 1024, bytes, secs * 1e3,
+           secs > 0 ? bytes / secs / 1e6 : 0.0, bstats.reads - reads,
+           bstats.ra_hits - ra_hits);
+  }
+
+  long raw = 0;
+  double start = now();
+  for (off_t off = 0; raw < bytes; off += n) {
+    if ((n = pread(dev, buf, sizeof(buf), off)) <= 0) break;
+    raw += n;
+  }
+  double secs = now() - start;
+  printf("raw image read: %ld bytes in %.3f ms (%.1f MB/s)\n", raw,
+         secs * 1e3, secs > 0 ? raw / secs / 1e6 : 0.0);
+}
+
+// two files grown together by 100 byte appends, the way two log writers
+// interleave; reports how many pieces each file ends up in
+static void bench_append(int kib) {
+  static const char *names[2] = {"bench.a", "bench.b"};
+  char chunk[100];
+  int fd[2], dev;
+
+  if (getino(&dev, names[0]) || getino(&dev, names[1])) {
+    err("bench.a or bench.b already exists");
+    return;
+  }
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  if ((uint32_t)kib * 2 + 64 >= me->super.s_free_blocks_count) {
+    err("not enough free blocks for that size");
+    return;
+  }
+
+  memset(chunk, 'x', sizeof(chunk));
+  for (int i = 0; i < 2; i++) {
+    loc_creat((char *)names[i]);
+    fd[i] = loc_open(names[i], W);
+  }
+
+  long ops = 0;
+  double start = now();
+  for (long bytes = 0; bytes < (long)kib * 1024; bytes += sizeof(chunk)) {
+    for (int i = 0; i < 2; i++, ops++) loc_write(fd[i], chunk, sizeof(chunk));
+  }
+  for (int i = 0; i < 2; i++) loc_close(fd[i]);
+  double secs = now() - start;
+
+  char name[64];
+  sprintf(name, "append, 2 files of %d KiB", kib);
+  report(name, ops, secs);
+
+  for (int i = 0; i < 2; i++) {
+    MINODE *mip = iget(dev, getino(&dev, names[i]));
+    int nblks = (file_size(&mip->INODE) + BLKSIZE - 1) / BLKSIZE, extents = 0;
+    for (int lbk = 0, prev = 0; lbk < nblks; lbk++) {
+      int blk = bmap(mip, lbk);
+      extents += blk != prev + 1;
+      prev = blk;
+    }
+    printf("%s: %d blocks in %d extents\n", names[i], nblks, extents);
+    iput(mip);
+    loc_unlink((char *)names[i]);
+  }
+}
+
+// stamp every 8 bytes of a chunk with its offset in the file
+static void stamp(uint64_t *words, off_t off, int len) {
+  for (int i = 0; i < len / 8; i++) words[i] = off + 8 * i;
+}
+
+// a sparse file of gib GiB: 1 MiB written every 256 MiB, through the
+// triple indirect blocks past 64 MiB, then read back and checked, along
+// with a hole in between
+static void bench_large(int gib) {
+  static uint64_t buf[(1 << 20) / 8], want[(1 << 20) / 8];
+  const char *name = "bench.large";
+  const off_t stride = 256 << 20, size = (off_t)gib << 30;
+  int nchunks = size / stride, dev;
+
+  if (getino(&dev, name)) {
+    err("bench.large already exists");
+    return;
+  }
+  // each chunk needs its data and a few indirect blocks
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  if ((uint32_t)nchunks * (sizeof(buf) / BLKSIZE + 8) + 64 >=
+      me->super.s_free_blocks_count) {
+    err("not enough free blocks for that size");
+    return;
+  }
+
+  loc_creat((char *)name);
+  int fd = loc_open(name, W);
+  double start = now();
+  for (int i = 0; i < nchunks; i++) {
+    stamp(buf, i * stride, sizeof(buf));
+    loc_lseek(fd, i * stride);
+    loc_write(fd, (char *)buf, sizeof(buf));
+  }
+  loc_lseek(fd, size - 1);
+  loc_write(fd, "", 1);
+  loc_close(fd);
+  double secs = now() - start;
+  printf("wrote %d MiB into a %d GiB file in %.3f ms (%.1f MB/s)\n", nchunks,
+         gib, secs * 1e3, secs > 0 ? nchunks * sizeof(buf) / secs / 1e6 : 0);
+
+  int bad = 0;
+  fd = loc_open(name, R);
+  start = now();
+  for (int i = 0; i < nchunks; i++) {
+    stamp(want, i * stride, sizeof(buf));
+    loc_lseek(fd, i * stride);
+    bad += loc_read(fd, (char *)buf, sizeof(buf)) != sizeof(buf) ||
+           memcmp(buf, want, sizeof(buf));
+
+    loc_lseek(fd, i * stride + stride / 2);
+    loc_read(fd, (char *)buf, BLKSIZE);
+    for (int j = 0; j < BLKSIZE / 8; j++) bad += buf[j] != 0;
+  }
+  secs = now() - start;
+  printf("read it back in %.3f ms (%.1f MB/s), size %lld\n", secs * 1e3,
+         secs > 0 ? nchunks * sizeof(buf) / secs / 1e6 : 0,
+         (long long)loc_stat(name).st_size);
+  loc_close(fd);
+  if (bad) err("large file read back wrong");
+
+  loc_unlink((char *)name);
+}
+
+// write a file of mib MiB, then cut it to half its length and delete it,
+// timing the two frees
+static void bench_truncate(int mib) {
+  static char buf[64 * BLKSIZE];
+  const char *name = "bench.trunc";
+  int dev;
+
+  if (getino(&dev, name)) {
+    err("bench.trunc already exists");
+    return;
+  }
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  if ((uint32_t)mib * (1024 + 8) + 64 >= me->super.s_free_blocks_count) {
+    err("not enough free blocks for that size");
+    return;
+  }
+  orphan_drain(-1);
+
+  loc_creat((char *)name);
+  int fd = loc_open(name, W);
+  memset(buf, 'x', sizeof(buf));
+  for (int i = 0; i < mib * 16; i++) loc_write(fd, buf, sizeof(buf));
+  loc_close(fd);
+
+  MINODE *mip = iget(dev, getino(&dev, name));
+  uint32_t blocks = mip->INODE.i_blocks / (BLKSIZE / 512);
+  double start = now();
+  truncat(mip, (off_t)mib << 19);
+  double half = now() - start;
+  uint32_t freed = blocks - mip->INODE.i_blocks / (BLKSIZE / 512);
+  iput(mip);
+
+  // the unlink only queues the inode; its blocks go in orphan_drain
+  start = now();
+  loc_unlink((char *)name);
+  orphan_drain(dev);
+  double rest = now() - start;
+
+  printf("truncate %d MiB to half: %u blocks freed in %.3f ms\n", mib, freed,
+         half * 1e3);
+  printf("delete the rest: %u blocks freed in %.3f ms\n", blocks - freed,
+         rest * 1e3);
+}
+
+// rm of a 1 MiB and of a mib MiB file: unlink returns at once either way,
+// the blocks are freed afterwards by slices of reclaim work
+static void bench_rm(int mib) {
+  static char buf[64 * BLKSIZE];
+  const char *name = "bench.rm";
+  int dev;
+
+  if (getino(&dev, name)) {
+    err("bench.rm already exists");
+    return;
+  }
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  if ((uint32_t)mib * (1024 + 8) + 64 >= me->super.s_free_blocks_count) {
+    err("not enough free blocks for that size");
+    return;
+  }
+  orphan_drain(-1);
+
+  memset(buf, 'x', sizeof(buf));
+  for (int size = 1; size <= mib; size = size < mib ? mib : mib + 1) {
+    loc_creat((char *)name);
+    int fd = loc_open(name, W);
+    for (int i = 0; i < size * 16; i++) loc_write(fd, buf, sizeof(buf));
+    loc_close(fd);
+
+    double start = now();
+    loc_rm((char *)name);
+    double rm = now() - start;
+
+    int slices = 0, freed;
+    start = now();
+    while ((freed = orphan_reclaim(ORPHAN_BATCH)) > 0) slices++;
+    double reclaim = now() - start;
+    printf("rm %d MiB: %.3f ms, then %d slices of reclaim in %.3f ms\n",
+           size, rm * 1e3, slices, reclaim * 1e3);
+  }
+}
+
+// n creats and then n unlinks in a fresh directory under cwd, four ways:
+// with the journal committing in groups as it does between shell commands,
+// and committing after every operation; without it, writing the dirty
+// blocks back after every operation as sync does, and also waiting for them
+// to reach the disk, the only crash-safe choice there is without a journal
+static void bench_journal(int n) {
+  static const char *modes[] = {
+      "journal, group commit", "journal, commit per op",
+      "no journal, write back per op", "no journal, barrier per op"};
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  struct journal *j = me->journal;
+  char name[32];
+  int dev;
+
+  if (!j) {
+    err("cwd filesystem has no journal");
+    return;
+  }
+  if (getino(&dev, "bench.j")) {
+    err("bench.j already exists");
+    return;
+  }
+
+  for (int mode = 0; mode < 4; mode++) {
+    loc_mkdir("bench.j");
+    journal_commit(me);
+    if (mode >= 2) {
+      journal_hold(me, 0);
+      me->journal = NULL;
+    }
+    unsigned long commits = jstats.commits, barriers = bstats.barriers;
+
+    double start = now();
+    for (int i = 0; i < 2 * n; i++) {
+      sprintf(name, "bench.j/f%d", i % n);
+      if (i < n) loc_creat(name);
+      else loc_unlink(name);
+      orphan_reclaim(ORPHAN_BATCH);
+
+      if (mode == 0) {
+        journal_tick();
+      } else if (mode == 1) {
+        journal_commit(me);
+      } else {
+        iflush(me);
+        alloc_sync(me);
+        bflush(me->dev);
+        if (mode == 3) bbarrier(me->dev);
+      }
+    }
+    if (mode == 0) journal_commit(me);
+    report(modes[mode], 2L * n, now() - start);
+    printf("  %lu commits, %lu barriers\n", jstats.commits - commits,
+           bstats.barriers - barriers);
+
+    me->journal = j;
+    journal_hold(me, 1);
+    loc_rmdir("bench.j");
+  }
+  journal_commit(me);
+}
+
+// n creats in a fresh directory under cwd, left uncommitted; then a quarter
+// of the cache is dirtied in the inode tables and pushed to the tail of the
+// lru by reads, so getblk has to commit, and the program stops dead as if
+// it crashed there. Mounting the image again replays the log, after which
+// fsck should find nothing wrong.
+static void bench_crash(int n) {
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  unsigned long commits = jstats.commits, forced = bstats.forced;
+  char name[32];
+  int dev;
+
+  if (!me->journal) {
+    err("cwd filesystem has no journal");
+    return;
+  }
+  if (getino(&dev, "bench.crash")) {
+    err("bench.crash already exists");
+    return;
+  }
+
+  loc_mkdir("bench.crash");
+  journal_commit(me);
+  for (int i = 0; i < n; i++) {
+    sprintf(name, "bench.crash/f%d", i);
+    loc_creat(name);
+  }
+
+  // rewritten as they stand; the new inodes are still only in the icache
+  uint32_t per_table = me->inodes_per_group * me->inode_size / BLKSIZE;
+  for (uint32_t i = 0; i < NBUF / 4; i++) {
+    GD *gd = &me->gd[i / per_table % me->ngroups];
+    struct buf *bp = bread(me->dev, gd->bg_inode_table + i % per_table);
+    bdirty(bp);
+    brelse(bp);
+  }
+  for (int i = 0; i < NBUF; i++) brelse(bread(me->dev, me->nblocks - 1 - i));
+
+  printf("%lu commits, %lu forced by the cache\n", jstats.commits - commits,
+         bstats.forced - forced);
+  fflush(stdout);
+  _exit(0);
+}
+
+// empty the caches and drop the image from the page cache, so what comes
+// next reads the device
+static void cold(struct mntable *me) {
+  sync_mnt_entries();
+  iinval(me->dev);
+  binval(me->dev);
+  fdatasync(me->dev);
+  posix_fadvise(me->dev, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// walk the tree under cwd breadth first from a cold cache, once with each
+// backend. The table blocks of a whole level's inodes are read ahead
+// together, then the blocks of all its directories, before any of it is
+// looked at, so the device has many requests to work on at once.
+static void bench_scan(void) {
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  enum aio_backend was = aio_get_backend();
+  char name[32];
+
+  if (bmapped(me->dev)) {
+    err("cannot scan a mapped image cold");
+    return;
+  }
+
+  for (enum aio_backend b = AIO_SYNC; b <= AIO_URING; b++) {
+    if (aio_set_backend(b) == -1) continue;
+    cold(me);
+
+    int n = 1, cap = 64, m;
+    uint32_t *level = malloc(cap * sizeof(*level));
+    uint32_t *next = malloc(cap * sizeof(*next));
+    unsigned long reads = bstats.reads, waits = aiostats.waits;
+    long entries = 0;
+    level[0] = running->cwd->ino;
+
+    double start = now();
+    for (; n; n = m) {
+      MINODE **mips = malloc(n * sizeof(*mips));
+      for (int i = 0; i < n; i++) inode_prefetch(me, level[i]);
+      for (int i = 0; i < n; i++) {
+        mips[i] = iget(me->dev, level[i]);
+        prefetch(mips[i], 0, mips[i]->INODE.i_size / BLKSIZE);
+      }
+
+      m = 0;
+      for (int i = 0; i < n; i++) {
+        struct dir_iter it;
+        struct ext2_dir_entry_2 *de;
+        dir_iter_start(&it, mips[i]);
+        while ((de = dir_iter_next(&it))) {
+          int dots = de->name_len <= 2 && de->name[0] == '.' &&
+                     (de->name_len == 1 || de->name[1] == '.');
+          if (dots) continue;
+          entries++;
+          if (de->file_type != EXT2_FT_DIR) continue;
+          if (m == cap) {
+            cap *= 2;
+            level = realloc(level, cap * sizeof(*level));
+            next = realloc(next, cap * sizeof(*next));
+          }
+          next[m++] = de->inode;
+        }
+        dir_iter_end(&it);
+        iput(mips[i]);
+      }
+      free(mips);
+
+      uint32_t *t = level;
+      level = next;
+      next = t;
+    }
+    snprintf(name, sizeof(name), "scan (%s)", aio_backend_name(b));
+    report(name, entries, now() - start);
+    printf("  %lu reads, %lu waits\n", bstats.reads - reads,
+           aiostats.waits - waits);
+    free(level);
+    free(next);
+  }
+  aio_set_backend(was);
+}
+
+// dirty every other block of a scratch file, n of them, and time writing
+// them back once with each backend: n one-block pwritevs either way, but
+// with io_uring or the pool all of them are in flight together
+static void bench_writeback(int n) {
+  static char buf[16 * BLKSIZE];
+  const char *name = "bench.wb";
+  struct mntable *me = dev_to_mnt_entry(running->cwd->dev);
+  enum aio_backend was = aio_get_backend();
+  char label[32];
+  int dev;
+
+  if (getino(&dev, name)) {
+    err("bench.wb already exists");
+    return;
+  }
+  if (n > NBUF / 2) n = NBUF / 2;
+
+  memset(buf, 'w', sizeof(buf));
+  loc_creat((char *)name);
+  int fd = loc_open(name, W);
+  for (int i = 0; i < 2 * n; i += 16) loc_write(fd, buf, sizeof(buf));
+  loc_close(fd);
+
+  MINODE *mip = iget(me->dev, getino(&dev, name));
+  uint32_t *blks = malloc(n * sizeof(*blks));
+  for (int i = 0; i < n; i++) blks[i] = bmap(mip, 2 * i);
+  iput(mip);
+
+  for (enum aio_backend b = AIO_SYNC; b <= AIO_URING; b++) {
+    if (aio_set_backend(b) == -1) continue;
+    sync_mnt_entries();
+    for (int i = 0; i < n; i++) {
+      struct buf *bp = bread(me->dev, blks[i]);
+      bdirty(bp);
+      brelse(bp);
+    }
+
+    double start = now();
+    bflush(me->dev);
+    snprintf(label, sizeof(label), "write back (%s)", aio_backend_name(b));
+    report(label, n, now() - start);
+  }
+  aio_set_backend(was);
+
+  free(blks);
+  loc_rm((char *)name);
+  orphan_drain(me->dev);
+}
+
+void bench(char *what, char *arg) {
+  int n = *arg ? atoi(arg) : 0;
+
+  if (!strcmp(what, "alloc")) {
+    bench_alloc(n ? n : 100000);
+  } else if (!strcmp(what, "mmap")) {
+    bench_mmap(n ? n : 3);
+  } else if (!strcmp(what, "dir")) {
+    bench_dir(n ? n : 100000);
+  } else if (!strcmp(what, "read")) {
+    bench_read(arg);
+  } else if (!strcmp(what, "path")) {
+    bench_path(n ? n : 64);
+  } else if (!strcmp(what, "append")) {
+    bench_append(n ? n : 256);
+  } else if (!strcmp(what, "large")) {
+    bench_large(n ? n : 4);
+  } else if (!strcmp(what, "truncate")) {
+    bench_truncate(n ? n : 60);
+  } else if (!strcmp(what, "rm")) {
+    bench_rm(n ? n : 60);
+  } else if (!strcmp(what, "scan")) {
+    bench_scan();
+  } else if (!strcmp(what, "writeback")) {
+    bench_writeback(n ? n : NBUF / 2);
+  } else if (!strcmp(what, "journal")) {
+    bench_journal(n ? n : 1000);
+  } else if (!strcmp(what, "crash")) {
+    bench_crash(n ? n : 200);
+  } else {
+    err("unknown benchmark");
+  }
+}
@@ -0,0 +1,593 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "cache.h"
+#include "util.h"
+
+static struct buf bufs[NBUF];
+static struct buf *hash_tbl[NBUF_HASH];
+static struct buf *lru_head, *lru_tail;
+
+#define NDEVMAP 8
+static struct devmap {
+  int dev;
+  uint8_t *base;
+  size_t size;
+  int dirty;  // written around the cache since the last msync
+} devmaps[NDEVMAP];
+
+#define NCLUSTER 64  // most blocks moved by one preadv or pwritev
+#define NHELD_SKIP 128  // buffers looked at for a victim that isn't held
+#define NRA_PINNED (NBUF / 2)  // most buffers pinned by reads in flight
+
+struct cache_stats bstats;
+static int ra_pinned;
+
+// devs whose dirty blocks must not reach the disk before the journal has
+// logged them, indexed by dev. commit logs them and writes them home; it is
+// called once limit of them are dirty, or when they fill the lru's tail, and
+// returns 0 if it can't run then (it is already running further up).
+static struct hold {
+  int (*commit)(int dev);
+  int limit, ndirty;
+} *held;
+static int held_size;
+
+static int is_held(int dev) { return dev < held_size && held[dev].commit; }
+
+static void set_dirty(struct buf *bp, int dirty) {
+  if (bp->dirty != dirty && is_held(bp->dev)) {
+    held[bp->dev].ndirty += dirty ? 1 : -1;
+  }
+  bp->dirty = dirty;
+}
+
+static unsigned hash(int dev, uint32_t blk) {
+  return ((unsigned)dev * 2654435761u ^ blk) % NBUF_HASH;
+}
+
+static void lru_unlink(struct buf *bp) {
+  if (bp->lru_prev) bp->lru_prev->lru_next = bp->lru_next;
+  else lru_head = bp->lru_next;
+  if (bp->lru_next) bp->lru_next->lru_prev = bp->lru_prev;
+  else lru_tail = bp->lru_prev;
+  bp->lru_prev = bp->lru_next = NULL;
+}
+
+static void lru_push_head(struct buf *bp) {
+  bp->lru_prev = NULL;
+  bp->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = bp;
+  lru_head = bp;
+  if (!lru_tail) lru_tail = bp;
+}
+
+static void hash_remove(struct buf *bp) {
+  struct buf **pp = &hash_tbl[hash(bp->dev, bp->blk)];
+  while (*pp && *pp != bp) pp = &(*pp)->hash_next;
+  if (*pp) *pp = bp->hash_next;
+  bp->hash_next = NULL;
+}
+
+static struct devmap *find_map(int dev) {
+  for (int i = 0; i < NDEVMAP; i++) {
+    if (devmaps[i].base && devmaps[i].dev == dev) return &devmaps[i];
+  }
+  return NULL;
+}
+
+static struct buf *lookup(int dev, uint32_t blk) {
+  struct buf *bp = hash_tbl[hash(dev, blk)];
+  while (bp && (bp->dev != dev || bp->blk != blk)) bp = bp->hash_next;
+  return bp;
+}
+
+// holds the block, or will once a read in flight lands
+static int cached(struct buf *bp) { return bp && (bp->valid || bp->reading); }
+
+static void bwait(struct buf *bp) {
+  while (bp->reading) aio_reap(1);
+}
+
+// write back bps[0..n), consecutive blocks of one device, with one pwritev.
+// mapped blocks are already in place, msync in bflush makes them durable
+static void bwrite_run(struct buf **bps, int n) {
+  struct iovec iov[NCLUSTER];
+
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = bps[i]->data;
+    iov[i].iov_len = BLKSIZE;
+    set_dirty(bps[i], 0);
+  }
+  if (bps[0]->data == bps[0]->mem) {
+    pwritev(bps[0]->dev, iov, n, (off_t)bps[0]->blk * BLKSIZE);
+    bstats.writes++;
+  }
+}
+
+// write back a buffer being recycled along with the dirty blocks cached
+// right after it, so a stream of evictions turns into a few large writes
+static void bwrite_cluster(struct buf *bp) {
+  struct buf *run[NCLUSTER], *next;
+  int n = 0;
+
+  run[n++] = bp;
+  while (n < NCLUSTER && (next = lookup(bp->dev, bp->blk + n)) &&
+         next->valid && next->dirty) {
+    run[n++] = next;
+  }
+  bwrite_run(run, n);
+}
+
+// find or recycle a buffer for (dev, blk), leaving it at the head of the lru
+static struct buf *getblk(int dev, uint32_t blk) {
+  static int initialized = 0;
+  if (!initialized) {
+    for (int i = 0; i < NBUF; i++) lru_push_head(&bufs[i]);
+    initialized = 1;
+  }
+
+  // a held dev commits well before its dirty blocks outgrow one transaction
+  if (is_held(dev) && held[dev].ndirty >= held[dev].limit) {
+    held[dev].commit(dev);
+  }
+
+  struct buf *bp = lookup(dev, blk);
+  if (bp) {
+    bstats.hits++;
+  } else {
+    bstats.misses++;
+
+    // recycle the least recently used unpinned buffer, writing it back;
+    // dirty blocks of held devs are passed over if something near the tail
+    // of the lru will do instead, and committed if nothing does. A commit
+    // can't be started inside another, so that one takes any clean buffer.
+    int skip = NHELD_SKIP;
+    bp = lru_tail;
+    while (bp && (bp->refCount || (bp->dirty && is_held(bp->dev)))) {
+      bp = --skip ? bp->lru_prev : NULL;
+    }
+    if (!bp) {
+      bp = lru_tail;
+      while (bp && bp->refCount) bp = bp->lru_prev;
+      assert(bp);
+      if (bp->dirty && is_held(bp->dev)) {
+        if (held[bp->dev].commit(bp->dev)) {
+          bstats.forced++;
+          bp = lru_tail;
+          while (bp && bp->refCount) bp = bp->lru_prev;
+        } else {
+          bp = lru_tail;
+          while (bp && (bp->refCount || (bp->dirty && is_held(bp->dev)))) {
+            bp = bp->lru_prev;
+          }
+        }
+        assert(bp);
+      }
+    }
+    if (bp->valid) {
+      if (bp->dirty) bwrite_cluster(bp);
+      hash_remove(bp);
+    }
+
+    bp->dev = dev;
+    bp->blk = blk;
+    bp->valid = 0;
+    bp->dirty = 0;
+    bp->readahead = 0;
+    bp->data = bp->mem;
+
+    struct devmap *map = find_map(dev);
+    if (map && ((size_t)blk + 1) * BLKSIZE <= map->size) {
+      bp->data = map->base + (size_t)blk * BLKSIZE;
+      bp->valid = 1;
+    }
+
+    unsigned h = hash(dev, blk);
+    bp->hash_next = hash_tbl[h];
+    hash_tbl[h] = bp;
+  }
+
+  lru_unlink(bp);
+  lru_push_head(bp);
+  bp->refCount++;
+  return bp;
+}
+
+static void ra_used(struct buf *bp) {
+  if (bp->readahead) {
+    bp->readahead = 0;
+    bstats.ra_hits++;
+  }
+}
+
+struct buf *bread(int dev, uint32_t blk) {
+  struct buf *bp = getblk(dev, blk);
+  bwait(bp);
+  if (!bp->valid) {
+    pread(dev, bp->data, BLKSIZE, (off_t)blk * BLKSIZE);
+    bstats.reads++;
+    bp->valid = 1;
+  }
+  ra_used(bp);
+  return bp;
+}
+
+// like bread but skips the device read; caller overwrites the whole block
+struct buf *bgetblk(int dev, uint32_t blk) {
+  struct buf *bp = getblk(dev, blk);
+  bwait(bp);
+  bp->valid = 1;
+  return bp;
+}
+
+// blocks the cache holds (they may be dirty) are copied out of it; every
+// stretch of the others is one pread straight into dst and is not cached
+void bread_direct(int dev, uint32_t blk, int n, uint8_t *dst) {
+  struct devmap *map = find_map(dev);
+  int i = 0;
+
+  while (i < n) {
+    struct buf *bp = lookup(dev, blk + i);
+    if (bp && bp->reading) bwait(bp);
+    if (bp && bp->valid) {
+      memcpy(dst + (size_t)i * BLKSIZE, bp->data, BLKSIZE);
+      bstats.hits++;
+      ra_used(bp);
+      i++;
+      continue;
+    }
+
+    int j = i + 1;
+    while (j < n && !((bp = lookup(dev, blk + j)) && bp->valid)) j++;
+
+    off_t off = (off_t)(blk + i) * BLKSIZE;
+    size_t len = (size_t)(j - i) * BLKSIZE;
+    if (map && off + len <= map->size) {
+      memcpy(dst + (size_t)i * BLKSIZE, map->base + off, len);
+    } else {
+      pread(dev, dst + (size_t)i * BLKSIZE, len, off);
+      bstats.reads++;
+    }
+    i = j;
+  }
+}
+
+// a readahead in flight: its buffers stay pinned until it lands
+struct ra_req {
+  struct aio_req req;
+  int n;
+  struct buf *run[NCLUSTER];
+  struct iovec iov[NCLUSTER];
+};
+
+// only the blocks read in full become valid; bread reads the rest itself
+static void ra_done(struct aio_req *req) {
+  struct ra_req *ra = (struct ra_req *)req;
+  int got = req->res > 0 ? req->res / BLKSIZE : 0;
+  for (int i = 0; i < ra->n; i++) {
+    ra->run[i]->valid = i < got;
+    ra->run[i]->reading = 0;
+    ra->run[i]->readahead = i < got;
+    brelse(ra->run[i]);
+  }
+  ra_pinned -= ra->n;
+  free(ra);
+}
+
+// start reading the uncached blocks among [blk, blk + n) into the cache,
+// each stretch of them with one preadv, all in flight together; whoever
+// asks for one of them first waits for it. Mapped devices need no help.
+void breadahead(int dev, uint32_t blk, int n) {
+  if (find_map(dev)) return;
+
+  for (int i = 0; i < n;) {
+    if (cached(lookup(dev, blk + i))) {
+      i++;
+      continue;
+    }
+    while (ra_pinned + NCLUSTER > NRA_PINNED) aio_reap(1);
+
+    struct ra_req *ra = malloc(sizeof(*ra));
+    int k = 0;
+    do {
+      ra->run[k] = getblk(dev, blk + i + k);
+      ra->run[k]->reading = 1;
+      ra->iov[k].iov_base = ra->run[k]->data;
+      ra->iov[k].iov_len = BLKSIZE;
+      k++;
+    } while (k < NCLUSTER && i + k < n && !cached(lookup(dev, blk + i + k)));
+
+    ra->n = k;
+    ra->req = (struct aio_req){.dev = dev,
+                               .off = (off_t)(blk + i) * BLKSIZE,
+                               .iov = ra->iov,
+                               .iovcnt = k,
+                               .end = ra_done};
+    ra_pinned += k;
+    bstats.reads++;
+    bstats.ra_blocks += k;
+    aio_submit(&ra->req);
+    i += k;
+  }
+  aio_kick();
+}
+
+// a block is about to be written around the cache: bring a cached copy in
+// step, it is clean afterwards
+static void bwritten(int dev, uint32_t blk, const uint8_t *src) {
+  struct buf *bp = lookup(dev, blk);
+  if (bp && bp->reading) bwait(bp);
+  if (bp && bp->valid) {
+    if (bp->data == bp->mem) memcpy(bp->data, src, BLKSIZE);
+    set_dirty(bp, 0);
+  }
+}
+
+// write n consecutive blocks from src with one pwrite; cached copies are
+// updated to match and are clean afterwards
+void bwrite_direct(int dev, uint32_t blk, int n, const uint8_t *src) {
+  struct devmap *map = find_map(dev);
+  off_t off = (off_t)blk * BLKSIZE;
+  size_t len = (size_t)n * BLKSIZE;
+
+  for (int i = 0; i < n; i++) {
+    bwritten(dev, blk + i, src + (size_t)i * BLKSIZE);
+  }
+
+  if (map && off + len <= map->size) {
+    memcpy(map->base + off, src, len);
+    map->dirty = 1;
+  } else {
+    pwrite(dev, src, len, off);
+    bstats.writes++;
+  }
+}
+
+// like bwrite_direct for blocks held in separate pages, a pwritev per
+// NCLUSTER blocks
+void bwrite_pages(int dev, uint32_t blk, int n, uint8_t *const *pages) {
+  struct devmap *map = find_map(dev);
+  struct iovec iov[NCLUSTER];
+
+  for (int i = 0; i < n; i += NCLUSTER) {
+    int k = n - i < NCLUSTER ? n - i : NCLUSTER;
+    off_t off = (off_t)(blk + i) * BLKSIZE;
+
+    for (int j = 0; j < k; j++) {
+      bwritten(dev, blk + i + j, pages[i + j]);
+      iov[j].iov_base = pages[i + j];
+      iov[j].iov_len = BLKSIZE;
+    }
+
+    if (map && off + (off_t)k * BLKSIZE <= (off_t)map->size) {
+      for (int j = 0; j < k; j++) {
+        memcpy(map->base + off + (size_t)j * BLKSIZE, pages[i + j], BLKSIZE);
+      }
+      map->dirty = 1;
+    } else {
+      pwritev(dev, iov, k, off);
+      bstats.writes++;
+    }
+  }
+}
+
+void bdirty(struct buf *bp) { set_dirty(bp, 1); }
+
+void brelse(struct buf *bp) {
+  assert(bp->refCount > 0);
+  bp->refCount--;
+}
+
+static int cmp_buf_blk(const void *a, const void *b) {
+  uint32_t x = (*(struct buf **)a)->blk, y = (*(struct buf **)b)->blk;
+  return (x > y) - (x < y);
+}
+
+// a write back in flight, of run[0..req.iovcnt)
+struct wb_req {
+  struct aio_req req;
+  struct buf **run;
+};
+
+static int wb_pending, wb_failed;
+
+// blocks that didn't make it to the disk are dirty again, and the write
+// back they were part of fails
+static void wb_done(struct aio_req *req) {
+  struct wb_req *wb = (struct wb_req *)req;
+  int put = req->res > 0 ? req->res / BLKSIZE : 0;
+  for (int i = put; i < req->iovcnt; i++) set_dirty(wb->run[i], 1);
+  if (put < req->iovcnt) wb_failed = 1;
+  wb_pending--;
+}
+
+// write back bps[0..n), distinct buffers in ascending block order, each run
+// of consecutive blocks as one pwritev and all the runs in flight together.
+// Mapped blocks are already in place, they are made durable by msync.
+// Returns -1 if any block wasn't written.
+static int bwrite_sorted(struct buf **bps, int n) {
+  static struct wb_req reqs[NBUF];
+  static struct iovec iov[NBUF];
+  int nreqs = 0;
+
+  wb_failed = 0;
+  for (int i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && j - i < NCLUSTER &&
+                    bps[j]->blk == bps[j - 1]->blk + 1;
+         j++)
+      ;
+    for (int k = i; k < j; k++) {
+      iov[k].iov_base = bps[k]->data;
+      iov[k].iov_len = BLKSIZE;
+      set_dirty(bps[k], 0);
+    }
+    if (bps[i]->data != bps[i]->mem) continue;
+
+    reqs[nreqs].req = (struct aio_req){.dev = bps[i]->dev,
+                                       .write = 1,
+                                       .off = (off_t)bps[i]->blk * BLKSIZE,
+                                       .iov = iov + i,
+                                       .iovcnt = j - i,
+                                       .end = wb_done};
+    reqs[nreqs].run = bps + i;
+    wb_pending++;
+    bstats.writes++;
+    aio_submit(&reqs[nreqs++].req);
+  }
+  aio_kick();
+  while (wb_pending) aio_reap(1);
+  return wb_failed ? -1 : 0;
+}
+
+// write back every dirty block of dev in ascending block order. Returns how
+// many there were, or -1 if not all of them reached the disk.
+int bflush(int dev) {
+  static struct buf *dirty[NBUF];
+  int n = bdirty_bufs(dev, dirty);
+  int failed = bwrite_sorted(dirty, n);
+
+  struct devmap *map = find_map(dev);
+  if (map && (n > 0 || map->dirty)) {
+    failed |= msync(map->base, map->size, MS_SYNC);
+    map->dirty = 0;
+    bstats.writes++;
+  }
+  return failed ? -1 : n;
+}
+
+// the dirty buffers of dev in ascending block order, out has room for NBUF
+int bdirty_bufs(int dev, struct buf **out) {
+  int n = 0;
+  for (int i = 0; i < NBUF; i++) {
+    if (bufs[i].valid && bufs[i].dirty && bufs[i].dev == dev) {
+      out[n++] = &bufs[i];
+    }
+  }
+  qsort(out, n, sizeof(*out), cmp_buf_blk);
+  return n;
+}
+
+int bdirty_count(int dev) {
+  int n = 0;
+  for (int i = 0; i < NBUF; i++) {
+    n += bufs[i].valid && bufs[i].dirty && bufs[i].dev == dev;
+  }
+  return n;
+}
+
+// wait until everything written to dev so far is on stable storage
+void bbarrier(int dev) {
+  struct devmap *map = find_map(dev);
+  if (map && map->dirty) {
+    msync(map->base, map->size, MS_SYNC);
+    map->dirty = 0;
+  }
+  fdatasync(dev);
+  bstats.barriers++;
+}
+
+void bhold(int dev, int (*commit)(int dev), int limit) {
+  if (dev >= held_size) {
+    int size = held_size ? held_size : 8;
+    while (size <= dev) size *= 2;
+    held = realloc(held, size * sizeof(*held));
+    memset(held + held_size, 0, (size - held_size) * sizeof(*held));
+    held_size = size;
+  }
+  held[dev] = (struct hold){commit, limit, commit ? bdirty_count(dev) : 0};
+}
+
+static int cmp_blk(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// write back just the listed blocks of dev that are cached dirty; blks is
+// sorted. Returns how many were written, or -1 if any of them failed.
+int bflush_blocks(int dev, uint32_t *blks, int n) {
+  static struct buf *run[NBUF];
+  struct devmap *map = find_map(dev);
+  int k = 0, failed = 0;
+
+  qsort(blks, n, sizeof(*blks), cmp_blk);
+  for (int i = 0; i < n; i++) {
+    struct buf *bp = lookup(dev, blks[i]);
+    if (bp && bp->valid && bp->dirty && (k == 0 || run[k - 1] != bp)) {
+      run[k++] = bp;
+    }
+  }
+
+  if (map) {
+    // msync works on whole pages
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0, j; i < k; i = j) {
+      for (j = i + 1; j < k && run[j]->blk == run[j - 1]->blk + 1; j++)
+        ;
+      off_t off = (off_t)run[i]->blk * BLKSIZE / page * page;
+      off_t end = (off_t)(run[j - 1]->blk + 1) * BLKSIZE;
+      failed |= msync(map->base + off, end - off, MS_SYNC);
+      bstats.writes++;
+    }
+  }
+  failed |= bwrite_sorted(run, k);
+  return failed ? -1 : k;
+}
+
+// drop all of dev's blocks, must be flushed first (fds are reused after close)
+void binval(int dev) {
+  aio_drain();
+  for (int i = 0; i < NBUF; i++) {
+    if (bufs[i].valid && bufs[i].dev == dev) {
+      assert(bufs[i].refCount == 0);
+      hash_remove(&bufs[i]);
+      set_dirty(&bufs[i], 0);
+      bufs[i].valid = 0;
+
+      lru_unlink(&bufs[i]);
+      bufs[i].lru_next = NULL;
+      bufs[i].lru_prev = lru_tail;
+      if (lru_tail) lru_tail->lru_next = &bufs[i];
+      lru_tail = &bufs[i];
+      if (!lru_head) lru_head = &bufs[i];
+    }
+  }
+
+  struct devmap *map = find_map(dev);
+  if (map) {
+    munmap(map->base, map->size);
+    map->base = NULL;
+  }
+}
+
+// map the whole image shared so bread hands out pointers into it without a
+// read or a copy; binval unmaps. returns -1 if the device can't be mapped
+int bmmap(int dev) {
+  struct stat st;
+  if (find_map(dev)) return 0;
+  if (fstat(dev, &st) == -1 || st.st_size < BLKSIZE) return -1;
+
+  struct devmap *map = NULL;
+  for (int i = 0; i < NDEVMAP && !map; i++) {
+    if (!devmaps[i].base) map = &devmaps[i];
+  }
+  if (!map) return -1;
+
+  void *base =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev, 0);
+  if (base == MAP_FAILED) return -1;
+
+  map->dev = dev;
+  map->base = base;
+  map->size = st.st_size;
+  map->dirty = 0;
+  return 0;
+}
+
+int bmapped(int dev) { return find_map(dev) != NULL; }
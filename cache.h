@@ -0,0 +1,66 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "type.h"
+
+#define NBUF 1024  // cache budget in blocks (1 MiB with 1 KiB blocks)
+#define NBUF_HASH 1031
+
+struct buf {
+  int dev;
+  uint32_t blk;
+  int valid;
+  int dirty;
+  int refCount;  // pinned while > 0, never recycled
+  int readahead;  // filled by breadahead and not yet asked for
+  int reading;    // an asynchronous read into data is in flight
+
+  struct buf *hash_next;
+  struct buf *lru_prev, *lru_next;  // head is most recently used
+
+  uint8_t *data;  // mem, or the block itself on an mmap-backed device
+  uint8_t mem[BLKSIZE];
+};
+
+struct cache_stats {
+  unsigned long hits, misses;
+  unsigned long reads, writes;  // device syscalls actually issued
+  unsigned long ra_blocks, ra_hits;  // blocks read ahead, and later used
+  unsigned long barriers;
+  unsigned long forced;  // commits of held devs to free a buffer
+};
+
+extern struct cache_stats bstats;
+
+// bread/bgetblk return pinned buffers; every call must be paired with brelse
+struct buf *bread(int dev, uint32_t blk);
+struct buf *bgetblk(int dev, uint32_t blk);
+void bdirty(struct buf *bp);
+void brelse(struct buf *bp);
+
+// copy n consecutive blocks to dst, bypassing the cache where it can
+void bread_direct(int dev, uint32_t blk, int n, uint8_t *dst);
+void breadahead(int dev, uint32_t blk, int n);
+void bwrite_direct(int dev, uint32_t blk, int n, const uint8_t *src);
+void bwrite_pages(int dev, uint32_t blk, int n, uint8_t *const *pages);
+
+int bflush(int dev);
+int bflush_blocks(int dev, uint32_t *blks, int n);
+void binval(int dev);
+
+int bdirty_bufs(int dev, struct buf **out);
+int bdirty_count(int dev);
+void bbarrier(int dev);
+// while held (commit not NULL), dev's dirty blocks are only written by the
+// flush calls above, which commit has to make once limit of them are dirty
+// or the cache needs one of their buffers; it returns 0 when called while
+// already committing, and limit must leave it buffers to do that with
+void bhold(int dev, int (*commit)(int dev), int limit);
+
+// serve dev's blocks straight out of a shared mapping of the whole image
+int bmmap(int dev);
+int bmapped(int dev);
+
+#endif
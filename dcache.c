@@ -0,0 +1,152 @@
+#include <ext2fs/ext2_fs.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dcache.h"
+
+struct dentry {
+  int valid;
+  int dev;
+  uint32_t parent, ino;
+
+  struct dentry *hash_next;
+  struct dentry *lru_prev, *lru_next;  // head is most recently used
+
+  uint8_t name_len;
+  char name[EXT2_NAME_LEN];
+};
+
+static struct dentry dentries[NDENTRY];
+static struct dentry *hash_tbl[NDENTRY_HASH];
+static struct dentry *lru_head, *lru_tail;
+
+struct dcache_stats dstats;
+
+static unsigned hash(int dev, uint32_t parent, const char *name, int len) {
+  unsigned h = 2166136261u ^ ((unsigned)dev * 2654435761u) ^ parent;
+  for (int i = 0; i < len; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+  return h % NDENTRY_HASH;
+}
+
+static void lru_unlink(struct dentry *d) {
+  if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+  else lru_head = d->lru_next;
+  if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+  else lru_tail = d->lru_prev;
+  d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push_head(struct dentry *d) {
+  d->lru_prev = NULL;
+  d->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = d;
+  lru_head = d;
+  if (!lru_tail) lru_tail = d;
+}
+
+static void lru_push_tail(struct dentry *d) {
+  d->lru_next = NULL;
+  d->lru_prev = lru_tail;
+  if (lru_tail) lru_tail->lru_next = d;
+  lru_tail = d;
+  if (!lru_head) lru_head = d;
+}
+
+static void hash_remove(struct dentry *d) {
+  struct dentry **pp =
+      &hash_tbl[hash(d->dev, d->parent, d->name, d->name_len)];
+  while (*pp && *pp != d) pp = &(*pp)->hash_next;
+  if (*pp) *pp = d->hash_next;
+  d->hash_next = NULL;
+}
+
+static struct dentry *lookup(int dev, uint32_t parent, const char *name,
+                             int len) {
+  struct dentry *d = hash_tbl[hash(dev, parent, name, len)];
+  while (d && (d->dev != dev || d->parent != parent || d->name_len != len ||
+               memcmp(d->name, name, len) != 0)) {
+    d = d->hash_next;
+  }
+  return d;
+}
+
+int dcache_lookup(int dev, uint32_t parent, const char *name, size_t len,
+                  uint32_t *ino) {
+  struct dentry *d = len <= EXT2_NAME_LEN ? lookup(dev, parent, name, len)
+                                          : NULL;
+  if (!d) {
+    dstats.misses++;
+    return 0;
+  }
+
+  if (d->ino) {
+    dstats.hits++;
+  } else {
+    dstats.neg_hits++;
+  }
+  lru_unlink(d);
+  lru_push_head(d);
+  *ino = d->ino;
+  return 1;
+}
+
+void dcache_enter(int dev, uint32_t parent, const char *name, size_t len,
+                  uint32_t ino) {
+  static int initialized = 0;
+  if (!initialized) {
+    for (int i = 0; i < NDENTRY; i++) lru_push_head(&dentries[i]);
+    initialized = 1;
+  }
+
+  if (len > EXT2_NAME_LEN) return;
+
+  struct dentry *d = lookup(dev, parent, name, len);
+  if (!d) {
+    // recycle the least recently used entry
+    d = lru_tail;
+    if (d->valid) hash_remove(d);
+
+    d->valid = 1;
+    d->dev = dev;
+    d->parent = parent;
+    d->name_len = len;
+    memcpy(d->name, name, len);
+
+    unsigned h = hash(dev, parent, name, len);
+    d->hash_next = hash_tbl[h];
+    hash_tbl[h] = d;
+  }
+
+  d->ino = ino;
+  lru_unlink(d);
+  lru_push_head(d);
+}
+
+static void purge(struct dentry *d) {
+  hash_remove(d);
+  d->valid = 0;
+  lru_unlink(d);
+  lru_push_tail(d);
+}
+
+// forget the names inside a directory that is going away (its inode number
+// may come back as a different directory)
+void dcache_purge_dir(int dev, uint32_t parent) {
+  for (int i = 0; i < NDENTRY; i++) {
+    if (dentries[i].valid && dentries[i].dev == dev &&
+        dentries[i].parent == parent) {
+      purge(&dentries[i]);
+    }
+  }
+}
+
+void dcache_purge_dev(int dev) {
+  for (int i = 0; i < NDENTRY; i++) {
+    if (dentries[i].valid && dentries[i].dev == dev) purge(&dentries[i]);
+  }
+}
+
+void dcache_print(void) {
+  printf("dentry cache: %lu hits, %lu negative hits, %lu misses\n",
+         dstats.hits, dstats.neg_hits, dstats.misses);
+}
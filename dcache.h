@@ -0,0 +1,26 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NDENTRY 4096
+#define NDENTRY_HASH 4099
+
+struct dcache_stats {
+  unsigned long hits, neg_hits, misses;
+};
+
+extern struct dcache_stats dstats;
+
+// name lookups in directory (dev, parent); ino 0 caches "does not exist"
+int dcache_lookup(int dev, uint32_t parent, const char *name, size_t len,
+                  uint32_t *ino);
+void dcache_enter(int dev, uint32_t parent, const char *name, size_t len,
+                  uint32_t ino);
+
+void dcache_purge_dir(int dev, uint32_t parent);
+void dcache_purge_dev(int dev);
+void dcache_print(void);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stddef.h>
+
+#include "cache.h"
+#include "dir.h"
+#include "fileio.h"
+#include "type.h"
+
+#define DIR_RA 32  // directory blocks read ahead at a time
+
+#define DE_NEXT(de) \
+  ((struct ext2_dir_entry_2 *)((uint8_t *)(de) + (de)->rec_len))
+
+void dir_iter_start(struct dir_iter *it, MINODE *dir) {
+  it->dir = dir;
+  it->lbk = -1;
+  it->nblks = dir->INODE.i_size / BLKSIZE;
+  it->bp = NULL;
+  it->de = it->prev = NULL;
+}
+
+// pin the next mapped block, holes in the directory are skipped; the
+// blocks after it are read ahead a window at a time
+static int next_block(struct dir_iter *it) {
+  if (it->bp) brelse(it->bp);
+  it->bp = NULL;
+
+  while (++it->lbk < it->nblks) {
+    if (it->lbk % DIR_RA == 0 && it->nblks - it->lbk > 1) {
+      prefetch(it->dir, it->lbk, DIR_RA);
+    }
+    int blk = bmap(it->dir, it->lbk);
+    if (blk) {
+      it->bp = bread(it->dir->dev, blk);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// next entry with a nonzero inode, NULL (and nothing pinned) at the end
+struct ext2_dir_entry_2 *dir_iter_next(struct dir_iter *it) {
+  for (;;) {
+    struct ext2_dir_entry_2 *de;
+
+    if (!it->de) {
+      if (!next_block(it)) return NULL;
+      it->prev = NULL;
+      de = (struct ext2_dir_entry_2 *)it->bp->data;
+    } else {
+      it->prev = it->de;
+      de = DE_NEXT(it->de);
+    }
+
+    // a short or overrunning rec_len ends the block rather than the walk
+    ptrdiff_t off = (uint8_t *)de - it->bp->data;
+    if (off >= BLKSIZE || de->rec_len < 8 || off + de->rec_len > BLKSIZE) {
+      it->de = NULL;
+      continue;
+    }
+
+    it->de = de;
+    if (de->inode) return de;
+  }
+}
+
+void dir_iter_end(struct dir_iter *it) {
+  if (it->bp) brelse(it->bp);
+  it->bp = NULL;
+  it->de = NULL;
+}
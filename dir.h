@@ -0,0 +1,21 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include <ext2fs/ext2_fs.h>
+
+#include "type.h"
+
+// walks the live entries of a directory across all of its blocks, keeping
+// only the block being looked at pinned
+struct dir_iter {
+  MINODE *dir;
+  int lbk, nblks;
+  struct buf *bp;                       // block holding de, NULL when done
+  struct ext2_dir_entry_2 *de, *prev;  // prev is de's predecessor in bp
+};
+
+void dir_iter_start(struct dir_iter *it, MINODE *dir);
+struct ext2_dir_entry_2 *dir_iter_next(struct dir_iter *it);
+void dir_iter_end(struct dir_iter *it);
+
+#endif
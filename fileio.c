@@ -1,8 +1,10 @@
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #include "alloc.h"
+#include "cache.h"
 #include "fileops.h"
 #include "fileio.h"
 #include "type.h"
@@ -11,6 +13,13 @@
 extern PROC *running;
 
 #define OFT_LEN NFD * 2
+#define IO_CHUNK (64 * BLKSIZE)  // cat and cp move data this much at a time
+#define RA_MIN 4                 // first readahead window, in blocks
+#define RA_MAX 256               // the window doubles up to this
+#define DALLOC_MAX 4096          // delayed pages an inode may hold
+#define NADDR (BLKSIZE / 4)      // block pointers in an indirect block
+// direct, single, double and triple indirect: about 16 GiB
+#define MAX_FILE_BLKS (12 + NADDR + NADDR * NADDR + NADDR * NADDR * NADDR)
 OFT oft[OFT_LEN];  // global oft table that all procs use
 
 static int alloc_fd(OFT **fd, OFT **out_file) {
@@ -42,8 +51,8 @@ static bool valid_fd(int fd) {
   return fd >= 0 && fd < NFD && running->fd[fd] != NULL;
 }
 
-int loc_open(char *filename, enum open_flags flags) {
-  int dev = path_start_dev(filename);
+int loc_open(const char *filename, enum open_flags flags) {
+  int dev;
   int ino = getino(&dev, filename);
   if (ino == 0) {
     return -1;
@@ -55,16 +64,21 @@ int loc_open(char *filename, enum open_flags flags) {
 
   OFT *open_file = {0};
   int fd = alloc_fd(running->fd, &open_file);
-  if (fd == -1) return fd;
+  if (fd == -1) {
+    iput(mip);
+    return fd;
+  }
 
   // initialize open_file OFT struct
   open_file->mptr = mip;
   open_file->mode = flags;
   if (flags == APPEND) {
-    open_file->offset = mip->INODE.i_size;
+    open_file->offset = file_size(&mip->INODE);
   } else {
     open_file->offset = 0;
   }
+  open_file->ra_prev = open_file->offset / BLKSIZE - 1;
+  open_file->ra_size = 0;
   open_file->refCount++;
 
   return fd;
@@ -75,6 +89,7 @@ int loc_close(int fd) {
     OFT *file = running->fd[fd];
 
     if (--file->refCount == 0) {
+      dalloc_flush(file->mptr);
       iput(file->mptr);
 
       // free file
@@ -86,121 +101,603 @@ int loc_close(int fd) {
   return -1;
 }
 
-void loc_lseek(int fd, int offset) {
+void loc_lseek(int fd, off_t offset) {
   if (!valid_fd(fd)) return;
 
   OFT *file = running->fd[fd];
   file->offset = offset;
 }
 
-int logical_to_physical(OFT *file, int logical_blk, int initialize) {
-  INODE *inode = &file->mptr->INODE;
+// follow the indirect block *ptr, with alloc set a missing one is allocated
+// near goal and zeroed. Returns it pinned, or NULL if it does not exist.
+static struct buf *get_ind(MINODE *mip, uint32_t *ptr, struct buf *parent,
+                           int alloc, int goal) {
+  if (*ptr) return bread(mip->dev, *ptr);
+  if (!alloc || !(*ptr = balloc(mip->dev, goal))) return NULL;
+
+  if (parent) bdirty(parent);
+  mip->INODE.i_blocks += BLKSIZE / 512;
+
+  struct buf *bp = bgetblk(mip->dev, *ptr);
+  memset(bp->data, 0, BLKSIZE);
+  bdirty(bp);
+  return bp;
+}
+
+// locate the block pointer for logical_blk. The returned buffer (NULL for
+// i_block slots) holds *slot pinned; *slot is NULL when it is not mapped.
+static struct buf *map_slot(MINODE *mip, int logical_blk, int alloc, int goal,
+                            uint32_t **slot) {
+  uint32_t *blocks = mip->INODE.i_block;
+  *slot = NULL;
+
   if (logical_blk < 12) {
-    return initialize ? inode->i_block[logical_blk] = balloc(file->mptr->dev)
-                      : inode->i_block[logical_blk];
-  } else if (logical_blk >= 12 && logical_blk < 256 + 12) {
-    if (logical_blk == 12 && initialize) {
-      inode->i_block[12] = balloc(file->mptr->dev);
-    }
+    *slot = &blocks[logical_blk];
+    return NULL;
+  }
 
-    int ind_blks[256];
-    logical_blk -= 12;
-    get_block_buf(file->mptr->dev, inode->i_block[12], ind_blks);
+  // i_block[11 + depth] maps span blocks through depth levels of
+  // indirect blocks
+  logical_blk -= 12;
+  int depth = 1;
+  uint32_t span = NADDR;
+  while ((uint32_t)logical_blk >= span) {
+    logical_blk -= span;
+    if (++depth > 3) return NULL;
+    span *= NADDR;
+  }
+
+  uint32_t *ptr = &blocks[11 + depth];
+  struct buf *bp = NULL;
+  while (span > 1) {
+    struct buf *next = get_ind(mip, ptr, bp, alloc, goal);
+    if (bp) brelse(bp);
+    if (!next) return NULL;
+    bp = next;
+    span /= NADDR;
+    ptr = (uint32_t *)bp->data + logical_blk / span % NADDR;
+  }
+
+  *slot = ptr;
+  return bp;
+}
 
-    if (initialize) {
-      ind_blks[logical_blk] = balloc(file->mptr->dev);
-      put_block(file->mptr->dev, inode->i_block[12], (char *)ind_blks);
+// logical blocks [lbk, lbk + len) live at [blk, blk + len)
+struct bmap_run {
+  uint32_t lbk, blk, len;
+};
+
+struct bmap_stats bmstats;
+
+// how many block pointers follow logical_blk's in the same i_block or
+// indirect block, itself included
+static int slots_left(int logical_blk) {
+  if (logical_blk < 12) return 12 - logical_blk;
+  return NADDR - (logical_blk - 12) % NADDR;
+}
+
+// index of the last run starting at or before lbk, -1 if there is none
+static int run_find(MINODE *mip, uint32_t lbk) {
+  int lo = 0, hi = mip->nruns - 1, at = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (mip->runs[mid].lbk <= lbk) {
+      at = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
     }
+  }
+  return at;
+}
+
+static int run_merge(MINODE *mip, int i) {
+  struct bmap_run *a = &mip->runs[i], *b = a + 1;
+  if (i < 0 || i + 1 >= mip->nruns || a->lbk + a->len != b->lbk ||
+      a->blk + a->len != b->blk) {
+    return 0;
+  }
+  a->len += b->len;
+  memmove(b, b + 1, (--mip->nruns - i - 1) * sizeof(*b));
+  return 1;
+}
+
+// add a run after index at, joining it with its neighbours when contiguous
+static void run_insert(MINODE *mip, int at, uint32_t lbk, uint32_t blk,
+                       uint32_t len) {
+  if (mip->nruns == mip->runs_cap) {
+    mip->runs_cap = mip->runs_cap ? 2 * mip->runs_cap : 4;
+    mip->runs = realloc(mip->runs, mip->runs_cap * sizeof(*mip->runs));
+  }
+
+  int i = at + 1;
+  memmove(&mip->runs[i + 1], &mip->runs[i],
+          (mip->nruns - i) * sizeof(*mip->runs));
+  mip->runs[i] = (struct bmap_run){lbk, blk, len};
+  mip->nruns++;
+
+  run_merge(mip, i);
+  run_merge(mip, i - 1);
+}
 
-    return ind_blks[logical_blk];
-  } else {  // logical is >= 268
-    if (logical_blk == 268 && initialize) {
-      inode->i_block[13] = balloc(file->mptr->dev);
+// physical block backing logical_blk, 0 for a hole. Mapped blocks are
+// remembered as runs decoded a whole pointer block stretch at a time, so
+// walking a file touches each indirect block once. Holes aren't cached:
+// filling one never changes a mapping that is, only truncation does.
+int bmap(MINODE *mip, int logical_blk) {
+  int at = run_find(mip, logical_blk);
+  if (at >= 0) {
+    struct bmap_run *r = &mip->runs[at];
+    if ((uint32_t)logical_blk < r->lbk + r->len) {
+      bmstats.hits++;
+      return r->blk + (logical_blk - r->lbk);
     }
+  }
+  bmstats.misses++;
+
+  uint32_t *slot;
+  struct buf *bp = map_slot(mip, logical_blk, 0, 0, &slot);
+  int blk = slot ? *slot : 0;
+  if (blk) {
+    int len = 1, max = slots_left(logical_blk);
+    if (at + 1 < mip->nruns && mip->runs[at + 1].lbk - logical_blk < max) {
+      max = mip->runs[at + 1].lbk - logical_blk;
+    }
+    while (len < max && slot[len] == (uint32_t)blk + len) len++;
+    run_insert(mip, at, logical_blk, blk, len);
+  }
+  if (bp) brelse(bp);
+  return blk;
+}
 
-    int dind_blks[256];
-    logical_blk -= 268;
-    get_block_buf(file->mptr->dev, inode->i_block[13], dind_blks);
+// like bmap, also giving how many blocks from logical_blk on are physically
+// contiguous with it (1 for a hole)
+static int bmap_extent(MINODE *mip, int logical_blk, int *len) {
+  int blk = bmap(mip, logical_blk);
+  *len = 1;
+  if (blk) {
+    struct bmap_run *r = &mip->runs[run_find(mip, logical_blk)];
+    *len = r->lbk + r->len - logical_blk;
+  }
+  return blk;
+}
 
-    int dindex = logical_blk / 256;
-    int doffset = logical_blk % 256;
+void bmap_inval(MINODE *mip) {
+  free(mip->runs);
+  mip->runs = NULL;
+  mip->nruns = mip->runs_cap = 0;
+}
 
-    // create new top-level dindirect block to hold indirect ones
-    if (doffset == 0 && initialize) {
-      dind_blks[dindex] = balloc(file->mptr->dev);
-      put_block(file->mptr->dev, inode->i_block[13], (char *)dind_blks);
+// delayed allocation: a write into a hole keeps its data in a page on the
+// MINODE and only reserves a block. dalloc_flush gives every page its block
+// at once, on close, on the last iput, at sync or when an inode holds
+// DALLOC_MAX pages, so a file written in small appends still gets its
+// blocks as one contiguous stretch.
+struct dpage {
+  uint32_t lbk;
+  uint8_t *data;
+};
+
+struct dalloc_stats dastats;
+
+// index of lbk's page, or -(insertion point) - 1
+static int dpage_find(MINODE *mip, uint32_t lbk) {
+  int lo = 0, hi = mip->ndpages - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (mip->dpages[mid].lbk == lbk) return mid;
+    if (mip->dpages[mid].lbk < lbk) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
     }
+  }
+  return -lo - 1;
+}
 
-    int dind_sub[256];
-    get_block_buf(file->mptr->dev, dind_blks[dindex], dind_sub);
+// is there a page for a logical block in [start, start + len)
+static int dpage_within(MINODE *mip, uint32_t start, uint32_t len) {
+  int i = dpage_find(mip, start);
+  if (i >= 0) return 1;
+  i = -i - 1;
+  return i < mip->ndpages && mip->dpages[i].lbk - start < len;
+}
 
-    if (initialize) {
-      dind_sub[doffset] = balloc(file->mptr->dev);
-      put_block(file->mptr->dev, dind_blks[dindex], (char *)dind_sub);
+// the indirect blocks a page for lbk would need that are neither mapped
+// nor already reserved for a page under them
+static int dpage_meta(MINODE *mip, uint32_t lbk) {
+  if (lbk < 12) return 0;
+
+  uint32_t off = lbk - 12, base = 12, cover = NADDR;
+  int depth = 1;
+  while (off >= cover && depth < 3) {
+    off -= cover;
+    base += cover;
+    cover *= NADDR;
+    depth++;
+  }
+
+  // cover is how many logical blocks the indirect block at hand maps
+  uint32_t blk = mip->INODE.i_block[11 + depth];
+  int need = 0;
+  for (; cover >= NADDR; cover /= NADDR) {
+    if (!blk) {
+      need += !dpage_within(mip, base + off / cover * cover, cover);
+    } else if (cover > NADDR) {
+      struct buf *bp = bread(mip->dev, blk);
+      blk = ((uint32_t *)bp->data)[off / (cover / NADDR) % NADDR];
+      brelse(bp);
     }
+  }
+  return need;
+}
 
-    return dind_sub[doffset];
+// lbk's page, made (zeroed, with its block and any indirect blocks it needs
+// reserved) if there is none yet; NULL when the filesystem can't promise
+// them
+static uint8_t *dpage_get(MINODE *mip, uint32_t lbk) {
+  int i = dpage_find(mip, lbk);
+  if (i >= 0) return mip->dpages[i].data;
+
+  struct mntable *me = mip->mptr;
+  int meta = dpage_meta(mip, lbk);
+  if (blocks_available(me) < (uint32_t)(1 + meta)) return NULL;
+  me->dalloc_reserved += 1 + meta;
+  mip->dmeta += meta;
+
+  if (mip->ndpages == mip->dpages_cap) {
+    mip->dpages_cap = mip->dpages_cap ? 2 * mip->dpages_cap : 16;
+    mip->dpages = realloc(mip->dpages, mip->dpages_cap * sizeof(*mip->dpages));
   }
-  return 0;
+  i = -i - 1;
+  memmove(&mip->dpages[i + 1], &mip->dpages[i],
+          (mip->ndpages - i) * sizeof(*mip->dpages));
+  mip->dpages[i].lbk = lbk;
+  mip->dpages[i].data = calloc(1, BLKSIZE);
+  mip->ndpages++;
+  dastats.pages++;
+  return mip->dpages[i].data;
 }
 
-void truncat(MINODE *mip) {
-  uint32_t *blocks = mip->INODE.i_block;
+// throw away the pages of logical blocks from on. The indirect blocks
+// reserved stay reserved while pages are left, those may rely on them.
+static void dalloc_drop(MINODE *mip, uint32_t from) {
+  int i = dpage_find(mip, from);
+  if (i < 0) i = -i - 1;
+
+  for (int j = i; j < mip->ndpages; j++) free(mip->dpages[j].data);
+  mip->mptr->dalloc_reserved -= mip->ndpages - i;
+  mip->ndpages = i;
+  if (i == 0) {
+    free(mip->dpages);
+    mip->dpages = NULL;
+    mip->dpages_cap = 0;
+    mip->mptr->dalloc_reserved -= mip->dmeta;
+    mip->dmeta = 0;
+  }
+}
 
-  for (int i = 0; blocks[i] && i < 12; i++) {
-    bdealloc(mip->dev, blocks[i]);
+void dalloc_flush(MINODE *mip) {
+  if (mip->ndpages == 0) return;
+
+  struct dpage *dp = mip->dpages;
+  uint8_t **pages = malloc(mip->ndpages * sizeof(*pages));
+  for (int i = 0; i < mip->ndpages; i++) pages[i] = dp[i].data;
+
+  // the reservation is handed back first so the allocator may use it
+  mip->mptr->dalloc_reserved -= mip->ndpages + mip->dmeta;
+  mip->dmeta = 0;
+
+  int lost = 0;
+  for (int i = 0, j; i < mip->ndpages; i = j) {
+    for (j = i + 1; j < mip->ndpages && dp[j].lbk == dp[j - 1].lbk + 1; j++)
+      ;
+    alloc_blocks(mip, dp[i].lbk, j - i);
+
+    // whatever part of the run got blocks is written
+    for (int k = i, run; k < j; k += run) {
+      int blk = bmap_extent(mip, dp[k].lbk, &run);
+      if (run > j - k) run = j - k;
+      if (!blk) {
+        lost += run;
+        continue;
+      }
+      bwrite_pages(mip->dev, blk, run, pages + k);
+      dastats.extents++;
+    }
+  }
+  if (lost) {
+    printf("%serror: no space left on device, %d blocks of data lost%s\n",
+           RED_COL, lost, REG_COL);
   }
 
-  if (blocks[12]) {
-    uint32_t *ind_blocks = get_block(mip->dev, blocks[12]);
-    for (int i = 0; ind_blocks[i] && i < 256; i++) {
-      bdealloc(mip->dev, ind_blocks[i]);
+  for (int i = 0; i < mip->ndpages; i++) free(pages[i]);
+  free(pages);
+  free(mip->dpages);
+  mip->dpages = NULL;
+  mip->ndpages = mip->dpages_cap = 0;
+  idirty(mip);
+  dastats.flushes++;
+}
+
+// point logical blocks [logical_blk, logical_blk + n) at start, start + 1...
+static void map_run(MINODE *mip, int logical_blk, int start, int n) {
+  for (int i = 0; i < n; i++) {
+    uint32_t *slot;
+    struct buf *bp = map_slot(mip, logical_blk + i, 1, start + n, &slot);
+    if (!slot) break;
+
+    *slot = start + i;
+    mip->INODE.i_blocks += BLKSIZE / 512;
+    if (bp) {
+      bdirty(bp);
+      brelse(bp);
     }
   }
+  idirty(mip);
+}
 
-  if (blocks[13]) {
-    uint32_t dind_blocks[BLKSIZE];
-    memcpy(dind_blocks, get_block(mip->dev, blocks[13]), BLKSIZE);
-    for (int i = 0; dind_blocks[i] && i < 256; i++) {
-      uint32_t *ind_blocks = get_block(mip->dev, dind_blocks[i]);
-      for (int j = 0; ind_blocks[j] && j < 256; j++) {
-        bdealloc(mip->dev, ind_blocks[i]);
-      }
-      bdealloc(mip->dev, dind_blocks[i]);
+// back every hole in logical blocks [logical_blk, logical_blk + n), each
+// stretch of holes as a contiguous run placed right after the block before it
+void alloc_blocks(MINODE *mip, int logical_blk, int n) {
+  int end = logical_blk + n;
+
+  while (logical_blk < end) {
+    if (bmap(mip, logical_blk)) {
+      logical_blk++;
+      continue;
     }
+
+    int want = 1;
+    while (logical_blk + want < end && !bmap(mip, logical_blk + want)) want++;
+
+    int prev = logical_blk ? bmap(mip, logical_blk - 1) : 0;
+    int goal = prev ? prev + 1 : ino_goal(mip->dev, mip->ino);
+
+    int got;
+    int start = balloc_range(mip->dev, goal, want, &got);
+    if (!start) return;  // out of space
+
+    map_run(mip, logical_blk, start, got);
+    logical_blk += got;
   }
+}
 
-  bdealloc(mip->dev, blocks[12]);
-  bdealloc(mip->dev, blocks[13]);
+// the largest size a regular file on me may grow to
+static off_t max_file_size(struct mntable *me) {
+  if (me->super.s_rev_level == EXT2_GOOD_OLD_REV) return INT32_MAX;
+  return (off_t)MAX_FILE_BLKS * BLKSIZE;
 }
 
-int _read(OFT *file, char buf[], int nbytes) {
-  static char blk_buf[BLKSIZE];
-  int count = 0;
-  INODE *inode = &file->mptr->INODE;
-  int avil = inode->i_size - file->offset;
+// blocks a truncate has unmapped, freed together once it is done
+struct freelist {
+  uint32_t *blks;
+  int n, cap;
+};
 
-  // if one data block is not enough, loop back to OUTER while for more ...
-  while (nbytes && avil) {
-    int lbk = file->offset / BLKSIZE;
-    int startByte = file->offset % BLKSIZE;
-    int blk = logical_to_physical(file, lbk, 0);
+static void freelist_add(struct freelist *fl, uint32_t blk) {
+  if (fl->n == fl->cap) {
+    fl->cap = fl->cap ? 2 * fl->cap : 256;
+    fl->blks = realloc(fl->blks, fl->cap * sizeof(*fl->blks));
+  }
+  fl->blks[fl->n++] = blk;
+}
 
-    get_block_buf(file->mptr->dev, blk, blk_buf);
+// unmap the logical blocks from keep on under *ptr, a subtree of depth
+// levels of indirect blocks whose first logical block is first. An
+// indirect block is only kept if it still maps something below keep.
+static void free_tree(MINODE *mip, uint32_t *ptr, struct buf *parent,
+                      int depth, uint32_t first, uint32_t keep,
+                      struct freelist *fl) {
+  if (!*ptr) return;
+
+  if (depth > 0) {
+    uint32_t span = 1;
+    for (int i = 1; i < depth; i++) span *= NADDR;
+    if (keep >= first + span * NADDR) return;  // nothing here goes
+
+    struct buf *bp = bread(mip->dev, *ptr);
+    uint32_t *ptrs = (uint32_t *)bp->data;
+    int i = first >= keep ? 0 : (keep - first + span - 1) / span;
+    if (i > 0 && i <= NADDR) {
+      // the child straddling keep is only cut short
+      free_tree(mip, &ptrs[i - 1], bp, depth - 1, first + (i - 1) * span, keep,
+                fl);
+    }
+    for (; i < NADDR; i++) free_tree(mip, &ptrs[i], bp, depth - 1, 0, 0, fl);
+    brelse(bp);
 
-    char *cp_start = blk_buf + startByte;
-    int remain = BLKSIZE - startByte;
+    if (first < keep) return;
+  } else if (first < keep) {
+    return;
+  }
 
-    int read_bytes = nbytes > remain ? remain : nbytes;
-    if (avil < read_bytes) {
-      read_bytes = avil;
-      avil = 0;
+  freelist_add(fl, *ptr);
+  *ptr = 0;
+  if (parent) bdirty(parent);
+}
+
+// zero the file from byte off to the end of its block, on disk or in the
+// block's page
+static void zero_tail(MINODE *mip, uint64_t off) {
+  int i, blk = bmap(mip, off / BLKSIZE);
+  if (blk) {
+    struct buf *bp = bread(mip->dev, blk);
+    memset(bp->data + off % BLKSIZE, 0, BLKSIZE - off % BLKSIZE);
+    bdirty(bp);
+    brelse(bp);
+  } else if ((i = dpage_find(mip, off / BLKSIZE)) >= 0) {
+    memset(mip->dpages[i].data + off % BLKSIZE, 0, BLKSIZE - off % BLKSIZE);
+  }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// cut or extend the file to length bytes: blocks past it are freed in one
+// batch, and the rest of the last block past the shorter of the two ends
+// reads as zeros
+void truncat(MINODE *mip, uint64_t length) {
+  uint32_t *blocks = mip->INODE.i_block;
+  uint32_t keep = (length + BLKSIZE - 1) / BLKSIZE;
+  uint64_t old = file_size(&mip->INODE);
+  struct freelist fl = {0};
+
+  bmap_inval(mip);
+  dalloc_drop(mip, keep);
+
+  // growing exposes the bytes after the old end, which a block may have
+  // kept from before it was allocated
+  if (length > old && old % BLKSIZE) {
+    zero_tail(mip, old);
+  } else if (length < old && length % BLKSIZE) {
+    zero_tail(mip, length);
+  }
+
+  for (int i = 0; i < 12; i++) {
+    free_tree(mip, &blocks[i], NULL, 0, i, keep, &fl);
+  }
+  uint32_t first = 12, span = NADDR;
+  for (int depth = 1; depth <= 3; depth++, span *= NADDR) {
+    free_tree(mip, &blocks[11 + depth], NULL, depth, first, keep, &fl);
+    first += span;
+  }
+
+  // data and indirect blocks come out in tree order, not block order; sorted,
+  // each physical run is freed as one range
+  qsort(fl.blks, fl.n, sizeof *fl.blks, cmp_u32);
+  bdealloc_list(mip->dev, fl.blks, fl.n);
+  mip->INODE.i_blocks -= fl.n * (BLKSIZE / 512);
+  free(fl.blks);
+
+  bmap_inval(mip);
+  set_file_size(mip, length);
+}
+
+void loc_truncate(char *path, uint64_t length) {
+  int dev;
+  int ino = getino(&dev, path);
+  if (ino == 0) {
+    err("does not exist");
+    return;
+  }
+  MINODE *mip = iget(dev, ino);
+  if ((mip->INODE.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+    err("not a regular file");
+  } else if ((off_t)length > max_file_size(mip->mptr)) {
+    err("file too large");
+  } else {
+    truncat(mip, length);
+  }
+  iput(mip);
+}
+
+uint64_t file_size(const INODE *inode) {
+  uint64_t size = inode->i_size;
+  if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+    size |= (uint64_t)inode->i_size_high << 32;
+  }
+  return size;
+}
+
+// sizes of 2 GiB and up need i_size_high, which older kernels only read
+// when the superblock says large_file
+void set_file_size(MINODE *mip, uint64_t size) {
+  mip->INODE.i_size = (uint32_t)size;
+  mip->INODE.i_size_high = size >> 32;
+  idirty(mip);
+
+  SUPER *super = &mip->mptr->super;
+  if (size > INT32_MAX &&
+      !(super->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    super->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+    mip->mptr->super_dirty = 1;
+  }
+}
+
+// prefetch logical blocks [lbk, lbk + n) of the file, and the indirect
+// blocks mapping them, a physically contiguous run per batch
+void prefetch(MINODE *mip, int lbk, int n) {
+  int nblks = (file_size(&mip->INODE) + BLKSIZE - 1) / BLKSIZE;
+  int end = lbk + n < nblks ? lbk + n : nblks;
+
+  while (lbk < end) {
+    int run;
+    int blk = bmap_extent(mip, lbk, &run);
+    if (run > end - lbk) run = end - lbk;
+    if (blk) breadahead(mip->dev, blk, run);
+    lbk += run;
+  }
+}
+
+// a reader continuing where it left off gets a window of blocks past its
+// read prefetched; once it reaches into that window the next one, twice
+// as big (and at least twice its reads), is fetched. Anything else turns
+// readahead off until it is sequential again. Reads of RA_MAX / 4 blocks
+// or more skip it: they are already a pread per run straight into place.
+static void readahead(OFT *file, int lbk, int last) {
+  int sequential = lbk == file->ra_prev || lbk == file->ra_prev + 1;
+  file->ra_prev = last;
+  if (!sequential || last - lbk + 1 >= RA_MAX / 4) {
+    file->ra_size = 0;
+    return;
+  }
+
+  int size = 2 * (last - lbk + 1);
+  if (file->ra_size == 0) {
+    file->ra_start = last + 1;
+    if (size < RA_MIN) size = RA_MIN;
+  } else if (last >= file->ra_start) {
+    int next = file->ra_start + file->ra_size;
+    file->ra_start = next > last + 1 ? next : last + 1;
+    if (size < 2 * file->ra_size) size = 2 * file->ra_size;
+  } else {
+    return;
+  }
+  file->ra_size = size < RA_MAX ? size : RA_MAX;
+  prefetch(file->mptr, file->ra_start, file->ra_size);
+}
+
+// whole blocks go straight into buf, a physically contiguous run at a time;
+// only a partial first or last block is copied out of the cache
+size_t _read(OFT *file, char buf[], size_t nbytes) {
+  MINODE *mip = file->mptr;
+  size_t count = 0;
+  off_t avil = (off_t)file_size(&mip->INODE) - file->offset;
+  if ((off_t)nbytes > avil) nbytes = avil > 0 ? avil : 0;
+  if (nbytes > 0) {
+    readahead(file, file->offset / BLKSIZE,
+              (file->offset + nbytes - 1) / BLKSIZE);
+  }
+
+  while (nbytes > 0) {
+    int lbk = file->offset / BLKSIZE;
+    int startByte = file->offset % BLKSIZE;
+    int run;
+    int blk = bmap_extent(mip, lbk, &run);
+
+    size_t read_bytes;
+    if (blk && startByte == 0 && nbytes >= BLKSIZE) {
+      int n = nbytes / BLKSIZE < (size_t)run ? nbytes / BLKSIZE : run;
+      bread_direct(mip->dev, blk, n, (uint8_t *)buf + count);
+      read_bytes = (size_t)n * BLKSIZE;
     } else {
-      avil -= read_bytes;
+      size_t remain = BLKSIZE - startByte;
+      read_bytes = nbytes > remain ? remain : nbytes;
+      int page;
+      if (blk) {
+        struct buf *bp = bread(mip->dev, blk);
+        memcpy(buf + count, bp->data + startByte, read_bytes);
+        brelse(bp);
+      } else if ((page = dpage_find(mip, lbk)) >= 0) {
+        memcpy(buf + count, mip->dpages[page].data + startByte, read_bytes);
+      } else {
+        memset(buf + count, 0, read_bytes);  // hole
+      }
     }
 
-    // !! OPTIMIZED !!
-    memcpy(buf + count, cp_start, read_bytes);
     count += read_bytes;
     file->offset += read_bytes;
     nbytes -= read_bytes;
@@ -208,58 +705,98 @@ int _read(OFT *file, char buf[], int nbytes) {
   return count;
 }
 
-int _write(OFT *file, char buf[], int nbytes) {
-  static char wbuf[BLKSIZE];
+// blocks that are already mapped are overwritten in place: whole ones
+// straight from buf, a physically contiguous run per pwrite, a partial
+// first or last one merged in the cache. Holes are filled in delayed pages
+// (see dalloc_flush), which never need reading in.
+size_t _write(OFT *file, char buf[], size_t nbytes) {
   MINODE *mip = file->mptr;
-  int count = 0;
+  size_t count = 0;
+
+  off_t room = max_file_size(mip->mptr) - file->offset;
+  if ((off_t)nbytes > room) {
+    err("file too large");
+    nbytes = room > 0 ? room : 0;
+  }
 
-  // loop back to while to write more .... until nbytes are written
   while (nbytes > 0) {
     int lbk = file->offset / BLKSIZE;
     int startByte = file->offset % BLKSIZE;
-    int blk = logical_to_physical(file, lbk, 1);
-
-    get_block_buf(mip->dev, blk, wbuf);
-
-    char *cp_start = wbuf + startByte;
-    int remain = BLKSIZE - startByte;
-
-    int write_bytes = nbytes > remain ? remain : nbytes;
+    size_t remain = BLKSIZE - startByte;
+    int run;
+    int blk = bmap_extent(mip, lbk, &run);
+
+    size_t write_bytes;
+    if (blk && startByte == 0 && nbytes >= BLKSIZE) {
+      int n = nbytes / BLKSIZE < (size_t)run ? nbytes / BLKSIZE : run;
+      bwrite_direct(mip->dev, blk, n, (uint8_t *)buf + count);
+      write_bytes = (size_t)n * BLKSIZE;
+    } else if (blk) {
+      write_bytes = nbytes > remain ? remain : nbytes;
+      struct buf *bp = bread(mip->dev, blk);
+      memcpy(bp->data + startByte, buf + count, write_bytes);
+      bdirty(bp);
+      brelse(bp);
+    } else {
+      // lbk may be among the pages flushed, so look it up again
+      if (mip->ndpages >= DALLOC_MAX) {
+        dalloc_flush(mip);
+        continue;
+      }
+      uint8_t *page = dpage_get(mip, lbk);
+      if (!page) {
+        err("no space left on device");
+        break;
+      }
+      write_bytes = nbytes > remain ? remain : nbytes;
+      memcpy(page + startByte, buf + count, write_bytes);
+    }
 
-    // !! OPTIMIZED !!
-    memcpy(cp_start + count, buf + count, write_bytes);
     file->offset += write_bytes;
     count += write_bytes;
     nbytes -= write_bytes;
 
-    if (file->offset > mip->INODE.i_size) mip->INODE.i_size = file->offset;
+  }
 
-    put_block(mip->dev, blk, wbuf);  // write wbuf[ ] to disk
+  if ((uint64_t)file->offset > file_size(&mip->INODE)) {
+    set_file_size(mip, file->offset);
   }
 
-  mip->dirty = 1;
-  iput(mip);
+  idirty(mip);
 
-  return nbytes;
+  return count;
 }
 
 void cp(char *src, char *dst) {
-  char dst_name_buf[256];
-  char buf[BLKSIZE];
-  int n = 0;
-  strcpy(dst_name_buf, dst);
+  static char buf[IO_CHUNK];
+  size_t n = 0;
   int fd = loc_open(src, 0);
   if (fd == -1) {
     err("copy source not found");
     return;
   }
 
-  if (loc_stat(dst_name_buf).st_ino == 0) {
-    strcpy(dst_name_buf, dst);
-    loc_creat(dst_name_buf);
+  if (loc_stat(dst).st_ino == 0) {
+    loc_creat(dst);
   }
   int gd = loc_open(dst, 1);
-  while ((n = loc_read(fd, buf, BLKSIZE))) {
+
+  // reserve the whole destination as one run before copying into it. A
+  // partial last block is merged over what the disk holds, so a freshly
+  // allocated one is cleared first
+  if (gd != -1) {
+    static const uint8_t zero[BLKSIZE];
+    MINODE *mip = running->fd[gd]->mptr;
+    uint64_t size = file_size(&running->fd[fd]->mptr->INODE);
+    uint32_t nblks = (size + BLKSIZE - 1) / BLKSIZE;
+    int fresh = nblks && !bmap(mip, nblks - 1);
+
+    alloc_blocks(mip, 0, nblks);
+    int last = nblks ? bmap(mip, nblks - 1) : 0;
+    if (fresh && last && size % BLKSIZE) bwrite_direct(mip->dev, last, 1, zero);
+  }
+
+  while ((n = loc_read(fd, buf, IO_CHUNK))) {
     loc_write(gd, buf, n);
   }
   loc_close(gd);
@@ -267,53 +804,45 @@ void cp(char *src, char *dst) {
 }
 
 void mv(char *src, char *dst) {
-  char src_buf[256], dst_buf[256];
-  strcpy(src_buf, src);
-  strcpy(dst_buf, dst);
-
-  int src_dev = path_start_dev(src);
-  int src_ino = getino(&src_dev, src_buf);
+  int src_dev;
+  int src_ino = getino(&src_dev, src);
   if (src_ino == 0) {
     err("source does not exist");
     return;
   }
   // MINODE *smip = iget(src_dev, src_ino);
 
-  int dst_dev = path_start_dev(src);
-  int dst_ino = getino(&dst_dev, dst_buf);
-  if (dst_ino != 0) {
+  int dst_dev;
+  char dst_base[EXT2_NAME_LEN + 1];
+  if (getino(&dst_dev, dst) != 0) {
     err("dest already exists");
     return;
   }
+  if (getino_parent(&dst_dev, dst, dst_base) == 0) {
+    err("dest directory does not exist");
+    return;
+  }
   if (dst_dev != src_dev) {
-    char src_buf[256];
-    strcpy(src_buf, src);
-
     cp(src, dst);
-    loc_unlink(src_buf);
+    loc_unlink(src);
     return;
   }
 
-  // MINODE *dmip = iget(dst_dev, dst_ino);
-
-  strcpy(src_buf, src);
-  strcpy(dst_buf, dst);
-  loc_link(src_buf, dst_buf);
+  loc_link(src, dst);
   loc_unlink(src);
 }
 
 void cat(char *file) {
+  static char buf[IO_CHUNK];
   int fd = loc_open(file, 0);
-  char buf[BLKSIZE] = {0};
-  int n = 0;
-  while ((n = loc_read(fd, buf, 1024))) {
-    buf[n] = 0;
-    printf("%s", buf);
+  size_t n = 0;
+  while ((n = loc_read(fd, buf, IO_CHUNK))) {
+    fwrite(buf, 1, n, stdout);
   }
   loc_close(fd);
 }
 
-int loc_read(int fd, char buf[], int nbytes) {
+size_t loc_read(int fd, char buf[], size_t nbytes) {
   if (!valid_fd(fd)) return 0;
 
   OFT *file = running->fd[fd];
@@ -326,7 +855,7 @@ int loc_read(int fd, char buf[], int nbytes) {
   return 0;
 }
 
-int loc_write(int fd, char buf[], int nbytes) {
+size_t loc_write(int fd, char buf[], size_t nbytes) {
   if (!valid_fd(fd)) return 0;
 
   OFT *file = running->fd[fd];
@@ -338,3 +867,47 @@ int loc_write(int fd, char buf[], int nbytes) {
 
   return 0;
 }
+
+// print an inode's size, block usage and how its data is laid out on disk
+void stat_file(char *path) {
+  int dev;
+  int ino = getino(&dev, path);
+  if (ino == 0) {
+    err("does not exist");
+    return;
+  }
+  MINODE *mip = iget(dev, ino);
+  INODE *inode = &mip->INODE;
+
+  printf("inode %d on dev %d: mode %o, size %llu, %u sectors, %d links\n",
+         ino, dev, inode->i_mode, (unsigned long long)file_size(inode),
+         inode->i_blocks, inode->i_links_count);
+
+  // symlink targets live in i_block itself
+  if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK) {
+    iput(mip);
+    return;
+  }
+
+  int nblks = (file_size(inode) + BLKSIZE - 1) / BLKSIZE;
+  int extents = 0, run_lbk = 0, run_blk = 0, run_len = 0;
+  for (int lbk = 0; lbk <= nblks; lbk++) {
+    int blk = lbk < nblks ? bmap(mip, lbk) : 0;
+    if (run_len && blk == run_blk + run_len) {
+      run_len++;
+      continue;
+    }
+
+    if (run_len) {
+      printf("  [%d-%d] -> %d-%d\n", run_lbk, run_lbk + run_len - 1, run_blk,
+             run_blk + run_len - 1);
+      extents++;
+    }
+    run_lbk = lbk;
+    run_blk = blk;
+    run_len = blk ? 1 : 0;
+  }
+  printf("%d extent%s\n", extents, extents == 1 ? "" : "s");
+
+  iput(mip);
+}
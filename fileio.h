@@ -5,16 +5,37 @@
 
 enum open_flags { R, W, RW, APPEND };
 
-int loc_open(char *filename, enum open_flags flags);
+int loc_open(const char *filename, enum open_flags flags);
 int loc_close(int fd);
-int loc_read(int fd, char buf[], int nbytes);
-int loc_write(int fd, char buf[], int nbytes);
-void loc_lseek(int fd, int offset);
+size_t loc_read(int fd, char buf[], size_t nbytes);
+size_t loc_write(int fd, char buf[], size_t nbytes);
+void loc_lseek(int fd, off_t offset);
 
 void cat(char *filename);
 void cp(char *src, char *dst);
 void mv(char *src, char *dst);
 
-void truncat(MINODE *mip);
+struct bmap_stats {
+  unsigned long hits, misses;
+};
+
+extern struct bmap_stats bmstats;
+
+struct dalloc_stats {
+  unsigned long pages, flushes, extents;
+};
+
+extern struct dalloc_stats dastats;
+
+void truncat(MINODE *mip, uint64_t length);
+void loc_truncate(char *path, uint64_t length);
+uint64_t file_size(const INODE *inode);
+void set_file_size(MINODE *mip, uint64_t size);
+int bmap(MINODE *mip, int logical_blk);
+void prefetch(MINODE *mip, int lbk, int n);
+void bmap_inval(MINODE *mip);
+void dalloc_flush(MINODE *mip);
+void alloc_blocks(MINODE *mip, int logical_blk, int n);
+void stat_file(char *path);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,6 @@
 #include <assert.h>
 #include <ext2fs/ext2_fs.h>
 #include <fcntl.h>
-#include <libgen.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,30 +10,26 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "aio.h"
 #include "alloc.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dir.h"
 #include "fileops.h"
 #include "mount.h"
 #include "fileio.h"
+#include "htree.h"
+#include "journal.h"
+#include "orphan.h"
+#include "path.h"
 #include "type.h"
 #include "util.h"
 
-#define MAX_PATH_DEPTH 20
-
-MINODE minode[NMINODE];
 MINODE *root;
 PROC proc[NPROC], *running;
 
-extern struct mntable mount_tbl[8];
-
-int path_start_dev(char *path) {
-  if (path == NULL) {
-    return running->cwd->dev;
-  } else if (path[0] == '/') {
-    return root->dev;
-  }
-
-  return running->cwd->dev;
-}
+extern struct mntable **mount_tbl;
+extern int nmounts;
 
 int get_dir_parent(uint8_t blk[BLKSIZE]) {
   // get .. entry
@@ -44,47 +39,36 @@ int get_dir_parent(uint8_t blk[BLKSIZE]) {
   return parent_ino_de->inode;
 }
 
-int tokenize_path_str(char *path_str, char **path) {
-  int nfiles = 0;
-
-  char *cur_path_file = strtok(path_str, "/");
-
-  while (cur_path_file && nfiles < MAX_PATH_DEPTH) {
-    path[nfiles++] = cur_path_file;
-    cur_path_file = strtok(NULL, "/");
-  }
-
-  return nfiles < MAX_PATH_DEPTH ? nfiles : -1;
-}
+// search directory's inode dir_entries for the name fname[0..fname_len)
+uint32_t search_dir(const char *fname, size_t fname_len, uint32_t dir_inode,
+                    int *dev) {
+  uint32_t found = 0;
+  if (fname_len == 0 || fname_len > EXT2_NAME_LEN) return 0;
+  if (dcache_lookup(*dev, dir_inode, fname, fname_len, &found)) return found;
 
-// search directory's inode dir_entries for filename
-uint32_t search_dir(const char *fname, uint32_t dir_inode, int *dev) {
-  static char entry_name[EXT2_NAME_LEN];
-
-  struct mntable *me = dev_to_mnt_entry(*dev);
-
-  if ((me->inode_tbl[dir_inode - 1].i_mode & EXT2_S_IFDIR) == 0) {
+  MINODE *dmip = iget(*dev, dir_inode);
+  if ((dmip->INODE.i_mode & EXT2_S_IFDIR) == 0) {
+    iput(dmip);
     return 0;
   }
 
-  struct ext2_inode *inode = &me->inode_tbl[dir_inode - 1];
-
-  struct ext2_dir_entry_2 *de = get_block(*dev, inode->i_block[0]),
-                          *end = (struct ext2_dir_entry_2 *)((uint8_t *)de +
-                                                             BLKSIZE);
-
-  while (de != end) {
-    memcpy(entry_name, de->name, de->name_len);
-    entry_name[de->name_len] = '\0';
-
-    if (strcmp(fname, entry_name) == 0) {
-      return de->inode;
+  if (!dx_indexed(dmip) || dx_lookup(dmip, fname, fname_len, &found) < 0) {
+    struct dir_iter it;
+    struct ext2_dir_entry_2 *de;
+    dir_iter_start(&it, dmip);
+    while ((de = dir_iter_next(&it))) {
+      if (de->name_len == fname_len &&
+          memcmp(fname, de->name, fname_len) == 0) {
+        found = de->inode;
+        break;
+      }
     }
-
-    de = (struct ext2_dir_entry_2 *)((uint8_t *)de + de->rec_len);
+    dir_iter_end(&it);
   }
 
-  return 0;
+  dcache_enter(*dev, dir_inode, fname, fname_len, found);
+  iput(dmip);
+  return found;
 }
 
 // return parent mount point and the ino of the parent dir ino that contains the
@@ -100,25 +84,28 @@ MINODE *get_mount_parent(int mnt_dev, int *out_parent_ino) {
   return mounted_inode;
 }
 
-// return tokenized filepath's inode
-uint32_t search_path(char **filepath, int nfiles, int start_root, int *dev) {
+// resolve the first len bytes of path from / or the cwd, crossing mount
+// points; *dev is set to the device the returned inode lives on
+static uint32_t search_path(const char *path, size_t len, int *dev) {
+  struct path_iter it;
   int new_dev;
-  if (nfiles == 0) return 2;
 
   uint32_t cur_inode = running->cwd->ino;
-  if (start_root) {
-    cur_inode = 2;
+  *dev = running->cwd->dev;
+  if (path[0] == '/') {
+    cur_inode = root->ino;
     *dev = root->dev;
   }
 
-  uint32_t prev_inode = 0;
-  for (int i = 0; i < nfiles; i++) {
-    prev_inode = cur_inode;
-    if ((cur_inode = search_dir(filepath[i], cur_inode, dev)) == 0) return 0;
+  path_iter_start(&it, path, len);
+  while (path_iter_next(&it)) {
+    uint32_t prev_inode = cur_inode;
+    cur_inode = search_dir(it.name, it.len, cur_inode, dev);
+    if (cur_inode == 0) return 0;
 
     // search up into parent partition
-    if (strncmp(filepath[i], "..", 2) == 0 && cur_inode == prev_inode &&
-        *dev != root->dev) {
+    if (it.len == 2 && memcmp(it.name, "..", 2) == 0 &&
+        cur_inode == prev_inode && *dev != root->dev) {
       int parent_ino;
       *dev = get_mount_parent(*dev, &parent_ino)->parent_mount;
       cur_inode = parent_ino;
@@ -132,25 +119,215 @@ uint32_t search_path(char **filepath, int nfiles, int start_root, int *dev) {
   return cur_inode;
 }
 
-int getino(int *dev, char *path) {
-  int start_root = path[0] == '/';
+int getino(int *dev, const char *path) {
+  return search_path(path, strlen(path), dev);
+}
+
+// resolve the directory that path's last component goes in, copying that
+// name to base; 0 if there is no such directory or the name is unusable
+int getino_parent(int *dev, const char *path, char base[EXT2_NAME_LEN + 1]) {
+  size_t len, dir_len;
+  const char *name = path_base(path, &len, &dir_len);
+  if (len == 0 || len > EXT2_NAME_LEN) return 0;
+
+  uint32_t ino = search_path(path, dir_len, dev);
+  if (ino == 0) return 0;
+
+  MINODE *pmip = iget(*dev, ino);
+  int is_dir = (pmip->INODE.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+  iput(pmip);
+  if (!is_dir) return 0;
+
+  memcpy(base, name, len);
+  base[len] = '\0';
+  return ino;
+}
+
+// in-core inodes are hashed by (dev, ino); unreferenced ones sit on an lru
+// list (head most recent) and are recycled once minode_capacity is reached
+static MINODE **minode_hash;
+static unsigned minode_nhash;
+static MINODE *lru_head, *lru_tail, *minode_free;
+static int minode_count, minode_capacity = NMINODE;
+
+struct icache_stats istats;
 
-  if (strcmp(path, "/") == 0) {
-    return root->ino;
+static unsigned ihash(int dev, int ino) {
+  return ((unsigned)dev * 2654435761u ^ (unsigned)ino) & (minode_nhash - 1);
+}
+
+static void ilru_unlink(MINODE *mip) {
+  if (mip->lru_prev) mip->lru_prev->lru_next = mip->lru_next;
+  else lru_head = mip->lru_next;
+  if (mip->lru_next) mip->lru_next->lru_prev = mip->lru_prev;
+  else lru_tail = mip->lru_prev;
+  mip->lru_prev = mip->lru_next = NULL;
+}
+
+static void ilru_push(MINODE *mip) {
+  mip->lru_prev = NULL;
+  mip->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = mip;
+  lru_head = mip;
+  if (!lru_tail) lru_tail = mip;
+}
+
+static void ihash_remove(MINODE *mip) {
+  MINODE **pp = &minode_hash[ihash(mip->dev, mip->ino)];
+  while (*pp && *pp != mip) pp = &(*pp)->hash_next;
+  if (*pp) *pp = mip->hash_next;
+  mip->hash_next = NULL;
+}
+
+static void ihash_insert(MINODE *mip) {
+  unsigned h = ihash(mip->dev, mip->ino);
+  mip->hash_next = minode_hash[h];
+  minode_hash[h] = mip;
+}
+
+// keep at least one bucket per cached inode
+static void ihash_resize(unsigned want) {
+  unsigned nhash = 64;
+  while (nhash < want) nhash <<= 1;
+  if (nhash <= minode_nhash) return;
+
+  MINODE **old = minode_hash;
+  unsigned old_nhash = minode_nhash;
+  minode_hash = calloc(nhash, sizeof(MINODE *));
+  minode_nhash = nhash;
+
+  for (unsigned i = 0; i < old_nhash; i++) {
+    for (MINODE *mip = old[i], *next; mip; mip = next) {
+      next = mip->hash_next;
+      ihash_insert(mip);
+    }
   }
-  if (strcmp(path, ".") == 0) {
-    return running->cwd->ino;
+  free(old);
+}
+
+static void idirty_unlink(MINODE *mip) {
+  if (!mip->dirty) return;  // flushed by a commit the write set off
+  if (mip->dirty_prev) mip->dirty_prev->dirty_next = mip->dirty_next;
+  else mip->mptr->dirty_inodes = mip->dirty_next;
+  if (mip->dirty_next) mip->dirty_next->dirty_prev = mip->dirty_prev;
+  mip->dirty_prev = mip->dirty_next = NULL;
+  mip->dirty = 0;
+}
+
+// the in-core inode changed; it is copied to the inode table by iflush
+void idirty(MINODE *mip) {
+  if (mip->dirty) return;
+  mip->dirty = 1;
+  mip->dirty_prev = NULL;
+  mip->dirty_next = mip->mptr->dirty_inodes;
+  if (mip->dirty_next) mip->dirty_next->dirty_prev = mip;
+  mip->mptr->dirty_inodes = mip;
+}
+
+static int cmp_minode_ino(const void *a, const void *b) {
+  int x = (*(MINODE *const *)a)->ino, y = (*(MINODE *const *)b)->ino;
+  return x < y ? -1 : x > y;
+}
+
+// copy me's dirty inodes into the inode table, in table order, and write
+// the table blocks they touched unless the journal does that. Returns the
+// blocks written.
+int iflush(struct mntable *me) {
+  int n = 0;
+  for (MINODE *mip = me->dirty_inodes; mip; mip = mip->dirty_next) n++;
+  me->inodes_synced = time(0);
+  if (n == 0) return 0;
+
+  MINODE **v = malloc(n * sizeof(*v));
+  uint32_t *blks = malloc(n * sizeof(*blks));
+  n = 0;
+  for (MINODE *mip = me->dirty_inodes; mip; mip = mip->dirty_next) {
+    v[n++] = mip;
+  }
+  qsort(v, n, sizeof(*v), cmp_minode_ino);
+
+  for (int i = 0; i < n; i++) {
+    blks[i] = inode_write(me, v[i]->ino, &v[i]->INODE);
+    idirty_unlink(v[i]);
+  }
+  int written = me->journal ? 0 : bflush_blocks(me->dev, blks, n);
+  if (written < 0) {
+    err("inode table write back failed");
+    written = 0;
+  }
+  istats.blocks_written += written;
+
+  free(blks);
+  free(v);
+  return written;
+}
+
+// the periodic flusher, run between shell commands
+void iflush_expired(void) {
+  time_t now = time(0);
+  for (int i = 0; i < nmounts; i++) {
+    if (mount_tbl[i]->dirty_inodes &&
+        now - mount_tbl[i]->inodes_synced >= INODE_SYNC_SECS) {
+      iflush(mount_tbl[i]);
+    }
+  }
+}
+
+// drop an unreferenced inode from the cache onto the free list; a dirty one
+// is copied into its table block first
+static void ievict(MINODE *mip) {
+  if (mip->dirty) {
+    inode_write(mip->mptr, mip->ino, &mip->INODE);
+    idirty_unlink(mip);
+  }
+  bmap_inval(mip);
+  ilru_unlink(mip);
+  ihash_remove(mip);
+  mip->ino = 0;
+  mip->dev = 0;
+  mip->lru_next = minode_free;
+  minode_free = mip;
+  minode_count--;
+  istats.evictions++;
+}
+
+void set_minode_capacity(int capacity) {
+  minode_capacity = capacity > 0 ? capacity : 1;
+  ihash_resize(minode_capacity);
+  while (minode_count > minode_capacity && lru_tail) ievict(lru_tail);
+}
+
+// forget every unreferenced inode of dev (its fd is about to be reused)
+void iinval(int dev) {
+  for (MINODE *mip = lru_tail, *prev; mip; mip = prev) {
+    prev = mip->lru_prev;
+    if (mip->dev == dev) ievict(mip);
   }
+}
 
-  char *path_tok[MAX_PATH_DEPTH] = {0};
-  int nfiles = tokenize_path_str(path, path_tok);
-  if (nfiles == -1) {
-    fprintf(stderr, "error: path too deep\n");
-    return 1;
+// whether anything (a cwd, an open file, a mount on it) holds an inode of
+// dev other than skip
+int ibusy(int dev, int skip) {
+  for (unsigned i = 0; i < minode_nhash; i++) {
+    for (MINODE *mip = minode_hash[i]; mip; mip = mip->hash_next) {
+      if (mip->dev == dev && mip->ino != skip && mip->refCount > 0) return 1;
+    }
   }
+  return 0;
+}
 
-  int file_ino = search_path(path_tok, nfiles, start_root, dev);
-  return file_ino;
+void icache_print(void) {
+  printf("inode cache: %d/%d cached, %lu hits, %lu misses, %lu evictions, "
+         "%lu table blocks written\n",
+         minode_count, minode_capacity, istats.hits, istats.misses,
+         istats.evictions, istats.blocks_written);
+}
+
+static MINODE *ilookup(int dev, int ino) {
+  if (!minode_hash) return NULL;
+  MINODE *mip = minode_hash[ihash(dev, ino)];
+  while (mip && (mip->ino != ino || mip->dev != dev)) mip = mip->hash_next;
+  return mip;
 }
 
 MINODE *iget(int dev, int ino) {
@@ -158,85 +335,99 @@ MINODE *iget(int dev, int ino) {
     return NULL;
   }
 
-  int i;
-  for (i = 0; i < NMINODE; i++) {
-    if (minode[i].ino == ino && minode[i].dev == dev) {
-      minode[i].refCount++;
-      return &minode[i];
-    }
-  }
-  int j = 0;
-  if (i == NMINODE) {
-    for (j = 0; j < NMINODE; j++) {
-      if (minode[j].ino == 0) {
-        break;
-      }
-    }
+  MINODE *mip = ilookup(dev, ino);
+  if (mip) {
+    istats.hits++;
+    if (mip->refCount++ == 0) ilru_unlink(mip);
+    return mip;
   }
+  istats.misses++;
 
-  minode[j].mptr = dev_to_mnt_entry(dev);
-  minode[j].INODE = minode[j].mptr->inode_tbl[ino - 1];
-  minode[j].ino = ino;
-  minode[j].refCount++;
-  minode[j].dev = dev;
+  // reuse the least recently used idle inode once the cache is full; if
+  // everything is referenced the cache grows past its capacity
+  if (minode_count >= minode_capacity && lru_tail) ievict(lru_tail);
 
-  return &minode[j];
+  if (minode_free) {
+    mip = minode_free;
+    minode_free = mip->lru_next;
+  } else {
+    mip = malloc(sizeof(MINODE));
+  }
+  memset(mip, 0, sizeof(MINODE));
+  minode_count++;
+  ihash_resize(minode_count);
+
+  mip->mptr = dev_to_mnt_entry(dev);
+  inode_read(mip->mptr, ino, &mip->INODE);
+  mip->ino = ino;
+  mip->refCount = 1;
+  mip->dev = dev;
+  ihash_insert(mip);
+
+  return mip;
 }
 
 void iput(MINODE *mip) {
-  mip->refCount--;
-  mip->mptr->inode_tbl[mip->ino - 1] = mip->INODE;
+  if (!mip) return;
+  if (mip->refCount == 1) dalloc_flush(mip);
+  if (--mip->refCount == 0) ilru_push(mip);
 }
 
-void mount_root(const char *fname) {
-  struct mntable *mte = mount_tbl;
+// give delayed pages their blocks and write every dirty inode to its table,
+// without dropping references
+void iput_all(void) {
+  for (unsigned i = 0; i < minode_nhash; i++) {
+    for (MINODE *mip = minode_hash[i]; mip; mip = mip->hash_next) {
+      dalloc_flush(mip);
+    }
+  }
+  for (int i = 0; i < nmounts; i++) iflush(mount_tbl[i]);
+}
 
+void mount_root(const char *fname, int use_mmap) {
   int dev = open(fname, O_RDWR);
   if (dev == -1) {
     perror("open");
     exit(1);
   }
+  if (use_mmap && bmmap(dev) == -1) {
+    err("cannot mmap image, using pread");
+  }
   struct ext2_super_block *super_block =
       (struct ext2_super_block *)get_block(dev, 1);
   if (super_block->s_magic != EXT2_SUPER_MAGIC) {
     err("not a valid ext2 filesystem");
     exit(EXIT_FAILURE);
   }
+  if (super_block->s_log_block_size != 0) {
+    err("only 1 KiB block filesystems are supported");
+    exit(EXIT_FAILURE);
+  }
 
   // initalize first mount table entry to /
+  struct mntable *mte = mnt_add(dev);
   mte->ninodes = super_block->s_inodes_count;
   mte->nblocks = super_block->s_blocks_count;
-  mte->dev = dev;
   mte->busy = 1;
 
   strcpy(mte->name, fname);
   strcpy(mte->mount_name, "/");
 
-  struct ext2_group_desc *group_desc = get_block(dev, 2);
-  mte->bmap = group_desc->bg_block_bitmap;
-  mte->imap = group_desc->bg_inode_bitmap;
-  mte->iblock = group_desc->bg_inode_table;
-
-  mte->inode_tbl_blk = group_desc->bg_inode_table;
-  mte->inode_tbl_size = mte->ninodes * sizeof(struct ext2_inode);
-
-  struct ext2_inode *inode_tbl = malloc(mte->inode_tbl_size);
-  pread(dev, inode_tbl, mte->inode_tbl_size, mte->inode_tbl_blk * BLKSIZE);
-
-  mte->inode_tbl = inode_tbl;
+  alloc_init(mte);
+  journal_load(mte);
+  orphan_load(mte);
   root = iget(dev, 2);
-  proc[0].cwd = iget(dev, 2);
-  proc[1].cwd = iget(dev, 2);
 
   mte->mounted_inode = root;
-  root->mptr = mte;
   // root->mounted = 1;
 }
 
-struct stat loc_stat(char *path) {
+static struct stat minode_stat(MINODE *minode);
+
+struct stat loc_stat(const char *path) {
   struct stat s;
 
-  int d = path_start_dev(path);
+  int d;
   int ino = getino(&d, path);
 
   // ino might be zero in case of error
@@ -248,6 +439,13 @@ struct stat loc_stat(char *path) {
   }
 
   MINODE *minode = iget(d, ino);
+  s = minode_stat(minode);
+  iput(minode);
+  return s;
+}
+
+static struct stat minode_stat(MINODE *minode) {
+  struct stat s;
 
   s.st_ino = minode->ino;
   s.st_dev = minode->dev;
@@ -255,7 +453,7 @@ struct stat loc_stat(char *path) {
   s.st_nlink = minode->INODE.i_links_count;
   s.st_uid = minode->INODE.i_uid;
   s.st_gid = minode->INODE.i_gid;
-  s.st_size = minode->INODE.i_size;
+  s.st_size = file_size(&minode->INODE);
   s.st_blksize = BLKSIZE;
   s.st_blocks = minode->INODE.i_blocks;
 
@@ -266,29 +464,63 @@ struct stat loc_stat(char *path) {
   return s;
 }
 
-int enter_child(
+#define DIR_PREALLOC 4
+
+// a directory block holding only the empty entry a fresh block starts with
+static int dir_blk_unused(int dev, int blk) {
+  if (!blk) return 1;
+  struct buf *bp = bread(dev, blk);
+  struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)bp->data;
+  int unused = de->inode == 0 && de->rec_len == BLKSIZE;
+  brelse(bp);
+  return unused;
+}
+
+// start logical blocks [lbk, lbk + n) off as empty directory blocks, each
+// one free entry spanning the block
+static int dir_grow(MINODE *parent, int lbk, int n) {
+  alloc_blocks(parent, lbk, n);
+
+  int got = 0;
+  for (int blk; got < n && (blk = bmap(parent, lbk + got)); got++) {
+    struct buf *bp = bgetblk(parent->dev, blk);
+    memset(bp->data, 0, BLKSIZE);
+    ((struct ext2_dir_entry_2 *)bp->data)->rec_len = BLKSIZE;
+    bdirty(bp);
+    brelse(bp);
+  }
+
+  parent->INODE.i_size += got * BLKSIZE;
+  idirty(parent);
+  return got;
+}
+
+static int dir_add(
     MINODE *parent, int ino, char *basename,
     uint8_t file_type) {  // there will be a rec_len overflow test case
 
   struct ext2_dir_entry_2 *new;
-  char *dir_blk;
-  int dir_blk_ino;
+  struct buf *bp;
   uint16_t new_rec_size;
 
-  int cur_block = 0;
+  if (dx_indexed(parent)) {
+    int added = dx_add(parent, basename, strlen(basename), ino, file_type);
+    if (added == 0) err("directory full");
+    if (added >= 0) return added;
+  }
 
-  // find most recent block
-  for (int i = 11; i >= 0; i--) {
-    if (parent->INODE.i_block[i]) {
-      cur_block = i;
-      break;
-    }
+  int nblks = parent->INODE.i_size / BLKSIZE;
+
+  // find most recent block, skipping still empty preallocated ones
+  int cur_block = nblks - 1;
+  while (cur_block > 0 &&
+         dir_blk_unused(parent->dev, bmap(parent, cur_block))) {
+    cur_block--;
   }
 
-  dir_blk_ino = parent->INODE.i_block[cur_block];
-  dir_blk = get_block(parent->dev, dir_blk_ino);
+  bp = bread(parent->dev, bmap(parent, cur_block));
 
-  struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)dir_blk;
+  struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)bp->data;
   struct ext2_dir_entry_2 *end =
       (struct ext2_dir_entry_2 *)((uint8_t *)de + BLKSIZE);
 
@@ -300,21 +532,31 @@ int enter_child(
   }
 
   uint16_t insert_size = EXT2_DIR_REC_LEN(strlen(basename));
-  uint16_t prev_rec_len = EXT2_DIR_REC_LEN(prev->name_len);
+  uint16_t prev_rec_len = prev->inode ? EXT2_DIR_REC_LEN(prev->name_len) : 0;
 
   // do we have to go to the next block?
   if (((char *)end - ((char *)prev + prev_rec_len)) < insert_size) {
     // puts("making new dir block!");
+    brelse(bp);
+
+    // a directory outgrowing its first block gets a hashed index instead
+    if (nblks == 1 && dx_make_indexed(parent)) {
+      return dir_add(parent, ino, basename, file_type);
+    }
 
-    dir_blk_ino = parent->INODE.i_block[++cur_block];
-    if (dir_blk_ino == 0) {
-      dir_blk_ino = balloc(parent->dev);
-      parent->INODE.i_block[cur_block] = dir_blk_ino;
-      iput(parent);
+    // grow by a contiguous run so the directory stays sequential on disk
+    if (++cur_block == nblks && !dir_grow(parent, nblks, DIR_PREALLOC)) {
+      err("no space left on device");
+      return 0;
     }
 
-    new = (struct ext2_dir_entry_2 *)get_block(parent->dev, dir_blk_ino);
+    bp = bread(parent->dev, bmap(parent, cur_block));
+    new = (struct ext2_dir_entry_2 *)bp->data;
     new_rec_size = BLKSIZE;
+  } else if (prev_rec_len == 0) {
+    // the block's only record is free, take it over
+    new = prev;
+    new_rec_size = prev->rec_len;
   } else {
     // find insertion offset
     uint16_t old_rec_len = prev->rec_len;
@@ -334,15 +576,45 @@ int enter_child(
 
   memcpy(new->name, basename, name_len);
 
-  put_block(parent->dev, dir_blk_ino, dir_blk);
+  bdirty(bp);
+  brelse(bp);
 
   return 1;
 }
 
+// a new inode whose name could not be entered is given back, unreachable
+// as it is
+static void discard_new(MINODE *mip) {
+  mip->INODE.i_links_count = 0;
+  mip->INODE.i_dtime = time(0);
+  idirty(mip);
+  idealloc(mip->dev, mip->ino);
+  iput(mip);
+}
+
+int enter_child(MINODE *parent, int ino, char *basename, uint8_t file_type) {
+  int added = dir_add(parent, ino, basename, file_type);
+  if (added) {
+    dcache_enter(parent->dev, parent->ino, basename, strlen(basename), ino);
+  }
+  return added;
+}
+
 void kmkdir(MINODE *pmip, char *base_name) {
-  int ino = ialloc(pmip->dev);
-  int blk = balloc(pmip->dev);
+  int ino = ialloc(pmip->dev, pmip->ino, 1);
+  if (!ino) {
+    err("no free inodes");
+    return;
+  }
+  int blk = balloc(pmip->dev, ino_goal(pmip->dev, ino));
+  if (!blk) {
+    idealloc(pmip->dev, ino);
+    err("no space left on device");
+    return;
+  }
   MINODE *mip = iget(pmip->dev, ino);
+  memset(&mip->INODE, 0, sizeof(INODE));  // may be a reused inode
+  bmap_inval(mip);
 
   time_t now = time(0);
 
@@ -360,12 +632,11 @@ void kmkdir(MINODE *pmip, char *base_name) {
   mip->INODE.i_mtime = now;
 
   mip->INODE.i_block[0] = blk;
-  mip->dirty = 1;
-  iput(mip);
+  idirty(mip);
 
   uint32_t old_rec_len;
 
-  char dir_blk_0[BLKSIZE];
+  char dir_blk_0[BLKSIZE] = {0};
   struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)dir_blk_0;
   // cur dir '.' entry
   de->inode = ino;
@@ -388,75 +659,80 @@ void kmkdir(MINODE *pmip, char *base_name) {
 
   put_block(mip->dev, blk, dir_blk_0);
 
-  enter_child(pmip, ino, base_name, EXT2_FT_DIR);
+  if (!enter_child(pmip, ino, base_name, EXT2_FT_DIR)) {
+    bdealloc(mip->dev, blk);
+    discard_new(mip);
+    return;
+  }
+  iput(mip);
+  incUsedDirs(pmip->dev, ino);
+  pmip->INODE.i_links_count++;
+  idirty(pmip);
 }
 
 void loc_mkdir(char *path) {
-  int dev = path[0] == '/' ? root->dev : running->cwd->dev;
-
-  char dir_name_buf[256];
-
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, path);
-  strcpy(base_buf, path);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
+  int dev;
+  char base_name[EXT2_NAME_LEN + 1];
 
-  strcpy(dir_name_buf, dir_name);
-  struct stat s = loc_stat(dir_name_buf);
-  if ((s.st_ino == 0) ||
-      (s.st_mode & EXT2_S_IFDIR) !=
-          EXT2_S_IFDIR) {  // dirname must exist and is a DIR
+  int parent_inode = getino_parent(&dev, path, base_name);
+  if (parent_inode == 0) {  // dirname must exist and is a DIR
     err("cannot create dir");
     return;
   }
-
-  int parent_inode = getino(&dev, dir_name);
   MINODE *pmip = iget(dev, parent_inode);
 
-  pmip->INODE.i_links_count++;
-  pmip->dirty = 1;
-
-  if ((pmip->INODE.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR)
-    return;  // check pmip is a dir
-  if (search_dir(base_name, pmip->ino, &dev))
-    return;  // basename must not exist in the parent dir
+  if (search_dir(base_name, strlen(base_name), pmip->ino, &dev)) {
+    // basename must not exist in pmip
+    iput(pmip);
+    return;
+  }
 
   kmkdir(pmip, base_name);
   iput(pmip);
 }
 
+// only . and .. left
 int dir_empty(MINODE *idir) {
-  struct ext2_dir_entry_2 *de = get_block(idir->dev, idir->INODE.i_block[0]),
-                          *end = (struct ext2_dir_entry_2 *)((uint8_t *)de +
-                                                             BLKSIZE);
+  struct dir_iter it;
+  struct ext2_dir_entry_2 *de;
   int cnt = 0;
-  while (de != end) {
-    de = (struct ext2_dir_entry_2 *)((uint8_t *)de + de->rec_len);
-    if (++cnt > 2) return 0;
-  }
-  return 1;
+
+  dir_iter_start(&it, idir);
+  while ((de = dir_iter_next(&it)) && ++cnt <= 2)
+    ;
+  dir_iter_end(&it);
+  return cnt <= 2;
 }
 
-void rm_child(MINODE *parent, char *name) {
-  char *blk = get_block(parent->dev, parent->INODE.i_block[0]);
+// unlink name from parent; its record is merged into the one before it, or
+// freed in place when it heads its block
+int rm_child(MINODE *parent, char *name) {
+  struct dir_iter it;
+  struct ext2_dir_entry_2 *de;
+  size_t name_len = strlen(name);
 
-  struct ext2_dir_entry_2 *de = (void *)blk,
-                          *end = (void *)((uint8_t *)de + BLKSIZE), *prev;
-  while (de != end) {
-    prev = de;
+  dcache_enter(parent->dev, parent->ino, name, name_len, 0);
 
-    de = (struct ext2_dir_entry_2 *)((uint8_t *)de + de->rec_len);
+  int removed;
+  if (dx_indexed(parent) &&
+      (removed = dx_remove(parent, name, name_len)) >= 0) {
+    return removed;
+  }
 
-    if (strncmp(de->name, name, de->name_len) == 0) {
-      prev->rec_len += de->rec_len;
-      put_block(parent->dev, parent->INODE.i_block[0], blk);
-      return;
+  dir_iter_start(&it, parent);
+  while ((de = dir_iter_next(&it))) {
+    if (de->name_len == name_len && memcmp(de->name, name, name_len) == 0) {
+      if (it.prev) {
+        it.prev->rec_len += de->rec_len;
+      } else {
+        de->inode = 0;
+      }
+      bdirty(it.bp);
+      break;
     }
   }
+  dir_iter_end(&it);
+  return de != NULL;
 }
 
 #define USER_DEL_DIR_PERM (EXT2_S_IWUSR | EXT2_S_IXUSR)
@@ -484,74 +760,92 @@ int check_permissions(MINODE *mip) {
   // return (mode & perm) == perm;
 }
 
+// remove directory mip, entered as base_name in pmip, whatever it contains
+void krmdir(MINODE *pmip, MINODE *mip, char *base_name) {
+  rm_child(pmip, base_name);
+  dcache_purge_dir(mip->dev, mip->ino);
+
+  truncat(mip, 0);
+  mip->INODE.i_links_count = 0;
+  mip->INODE.i_dtime = time(0);
+  idirty(mip);
+  idealloc(mip->dev, mip->ino);
+  decUsedDirs(mip->dev, mip->ino);
+  pmip->INODE.i_links_count--;
+  idirty(pmip);
+}
+
 void loc_rmdir(char *path) {
   if (strcmp(path, ".") == 0) {
     err("cannot delete current directory");
     return;
   }
 
-  int dev = path[0] == '/' ? root->dev : running->cwd->dev;
-
-  char path_cpy[256];
-  strcpy(path_cpy, path);
-
-  int ino = getino(&dev, path_cpy);
+  int dev;
+  int ino = getino(&dev, path);
+  if (ino == 0) {
+    err("cannot delete...");
+    return;
+  }
   MINODE *mip = iget(dev, ino);
 
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, path);
-  strcpy(base_buf, path);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
-
-  strcpy(path_cpy, path);
-  struct stat s = loc_stat(path_cpy);
-  if ((s.st_ino == 0) ||
-      (s.st_mode & EXT2_S_IFDIR) !=
-          EXT2_S_IFDIR) {  // dirname must exist and is a DIR
+  if ((mip->INODE.i_mode & EXT2_S_IFDIR) !=
+      EXT2_S_IFDIR) {  // path must exist and is a DIR
     err("cannot delete...");
+    iput(mip);
     return;
   }
 
-  if ((mip->INODE.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) return;
-
   if (!check_permissions(mip)) {
     err("insufficient permissions");
+    iput(mip);
     return;
   }
 
   if (!dir_empty(mip)) {
     err("dir not empty");
+    iput(mip);
     return;
   }
 
-  int parent_inode = getino(&dev, dir_name);
+  char base_name[EXT2_NAME_LEN + 1];
+  int parent_inode = getino_parent(&dev, path, base_name);
+  if (parent_inode == 0) {
+    err("cannot delete...");
+    iput(mip);
+    return;
+  }
   MINODE *pmip = iget(dev, parent_inode);
 
-  rm_child(pmip, base_name);
-
-  truncat(mip);
-  idealloc(dev, ino);
+  krmdir(pmip, mip, base_name);
   iput(mip);
-  pmip->dirty = 1;
   iput(pmip);
 }
 
 void loc_creat(char *path) {
-  char path_buf[256];
-  strcpy(path_buf, path);
-
-  int dev = path_start_dev(path);
-  if (getino(&dev, path_buf) != 0) {
+  int dev;
+  if (getino(&dev, path) != 0) {
     err("file already exists");
     return;
   }
 
-  int ino = ialloc(dev);
+  char base_name[EXT2_NAME_LEN + 1];
+  int parent_inode = getino_parent(&dev, path, base_name);
+  if (parent_inode == 0) {
+    err("cannot create file");
+    return;
+  }
+  MINODE *pmip = iget(dev, parent_inode);
+
+  int ino = ialloc(dev, pmip->ino, 0);
+  if (!ino) {
+    err("no free inodes");
+    iput(pmip);
+    return;
+  }
   MINODE *mip = iget(dev, ino);
+  memset(&mip->INODE, 0, sizeof(INODE));  // may be a reused inode
+  bmap_inval(mip);
 
   time_t now = time(0);
   mip->INODE.i_mode =
@@ -570,39 +864,32 @@ void loc_creat(char *path) {
   mip->INODE.i_mtime = now;
 
   mip->INODE.i_block[0] = 0;
-  mip->dirty = 1;
-  iput(mip);
-
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, path);
-  strcpy(base_buf, path);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
+  idirty(mip);
 
-  int parent_inode = getino(&dev, dir_name);
-  MINODE *pmip = iget(dev, parent_inode);
-
-  enter_child(pmip, ino, base_name, (uint8_t)EXT2_FT_REG_FILE);
+  if (enter_child(pmip, ino, base_name, (uint8_t)EXT2_FT_REG_FILE)) {
+    iput(mip);
+  } else {
+    discard_new(mip);
+  }
+  idirty(pmip);
+  iput(pmip);
 }
 
-static int find_dir_name(uint8_t *dir_blk, int inode, char *out_name) {
-  struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)dir_blk;
-  struct ext2_dir_entry_2 *end =
-      (struct ext2_dir_entry_2 *)((uint8_t *)de + BLKSIZE);
+static int find_dir_name(MINODE *dir, int inode, char *out_name) {
+  struct dir_iter it;
+  struct ext2_dir_entry_2 *de;
+  int len = 0;
 
-  while (de != end) {
+  dir_iter_start(&it, dir);
+  while ((de = dir_iter_next(&it))) {
     if (de->inode == inode) {
       memcpy(out_name, de->name, de->name_len);
-      return de->name_len;
+      len = de->name_len;
+      break;
     }
-
-    de = (struct ext2_dir_entry_2 *)((uint8_t *)de + de->rec_len);
   }
-
-  return 0;
+  dir_iter_end(&it);
+  return len;
 }
 
 static int pwd_rec(MINODE *mip, int ino_search, char *working_dir) {
@@ -610,8 +897,7 @@ static int pwd_rec(MINODE *mip, int ino_search, char *working_dir) {
 
   if (mip->ino == 2 && mip->dev == root->dev) {
     *working_dir++ = '/';
-    get_block_buf(mip->dev, mip->INODE.i_block[0], blk);
-    return 1 + find_dir_name(blk, ino_search, working_dir);
+    return 1 + find_dir_name(mip, ino_search, working_dir);
   }
 
   get_block_buf(mip->dev, mip->INODE.i_block[0], blk);
@@ -629,19 +915,23 @@ static int pwd_rec(MINODE *mip, int ino_search, char *working_dir) {
   }
 
   int cur_name_len = pwd_rec(pino, mip->ino, working_dir);
+  iput(pino);
 
   if (ino_search != 0) {
     working_dir += cur_name_len;
     *working_dir++ = '/';
 
     // traversing down searching for names and cross mount pt
-    int dev = mip->dev;
+    int dev = mip->dev, name_len;
     if (mip->mounted && (dev = find_mnt_dev(mip->dev, mip->ino))) {
-      mip = iget(dev, 2);
+      MINODE *mnt_root = iget(dev, 2);
+      name_len = find_dir_name(mnt_root, ino_search, working_dir);
+      iput(mnt_root);
+    } else {
+      name_len = find_dir_name(mip, ino_search, working_dir);
     }
 
-    get_block_buf(dev, mip->INODE.i_block[0], blk);
-    return 1 + cur_name_len + find_dir_name(blk, ino_search, working_dir);
+    return 1 + cur_name_len + name_len;
   }
 
   *(working_dir + cur_name_len) = '\0';
@@ -663,138 +953,120 @@ char *pwd(char *out_path) {
 }
 
 void loc_link(char *old_name, char *new_name) {
-  char old_name_buf[256];
-  char new_name_buf[256];
-
-  strcpy(old_name_buf, old_name);
-
-  int dev = path_start_dev(old_name);
-  int oino = getino(&dev, old_name_buf);
-  MINODE *omip = iget(dev, oino);
-
-  strcpy(old_name_buf, old_name);
-  strcpy(new_name_buf, new_name);
-  struct stat s = loc_stat(old_name_buf);
-  if (s.st_ino == 0) {
+  int dev, new_dev;
+  int oino = getino(&dev, old_name);
+  if (oino == 0) {
     err("failed ino");
     return;
-  } else if ((s.st_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
+  }
+  MINODE *omip = iget(dev, oino);
+
+  char base_name[EXT2_NAME_LEN + 1];
+  int parent_inode;
+  if ((omip->INODE.i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
     err("failed dir");
+    iput(omip);
     return;
-  } else if (getino(&dev, new_name_buf) != 0) {
+  } else if (getino(&new_dev, new_name) != 0) {
     err("already exists");
+    iput(omip);
+    return;
+  } else if ((parent_inode = getino_parent(&new_dev, new_name, base_name)) ==
+                 0 ||
+             new_dev != dev) {
+    err("cannot link there");
+    iput(omip);
     return;
   }
 
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, new_name);
-  strcpy(base_buf, new_name);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
-
-  int parent_inode = getino(&dev, dir_name);
   MINODE *pmip = iget(dev, parent_inode);
 
-  enter_child(pmip, omip->ino, base_name, EXT2_FT_REG_FILE);
-  omip->INODE.i_links_count++;
-  omip->dirty = 1;
+  int added = enter_child(pmip, omip->ino, base_name, EXT2_FT_REG_FILE);
+  if (added) {
+    omip->INODE.i_links_count++;
+    idirty(omip);
+  }
   iput(omip);
   iput(pmip);
 
-  printf("created %s -> %s\n", old_name, new_name);
+  if (added) printf("created %s -> %s\n", old_name, new_name);
 }
 
 void loc_unlink(char *pathname) {
-  char pathname_buf[256];
-
-  strcpy(pathname_buf, pathname);
-
-  int dev = path_start_dev(pathname);
-  int ino = getino(&dev, pathname_buf);
-  MINODE *mip = iget(dev, ino);
-
-  strcpy(pathname_buf, pathname);
-  struct stat s = loc_stat(pathname_buf);
-  if (s.st_ino == 0) {
+  int dev;
+  int ino = getino(&dev, pathname);
+  if (ino == 0) {
     err("does not exist");
     return;
-  } else if ((s.st_mode & EXT2_S_IFREG) != EXT2_S_IFREG &&
-             (s.st_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK) {
+  }
+  MINODE *mip = iget(dev, ino);
+
+  uint16_t mode = mip->INODE.i_mode;
+  if ((mode & EXT2_S_IFREG) != EXT2_S_IFREG &&
+      (mode & EXT2_S_IFLNK) != EXT2_S_IFLNK) {
     err("is NOT REG or SLINK");
+    iput(mip);
     return;
   }
 
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, pathname);
-  strcpy(base_buf, pathname);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
-
-  int parent_inode = getino(&dev, dir_name);
+  char base_name[EXT2_NAME_LEN + 1];
+  int parent_inode = getino_parent(&dev, pathname, base_name);
+  if (parent_inode == 0) {
+    err("does not exist");
+    iput(mip);
+    return;
+  }
   MINODE *pmip = iget(dev, parent_inode);
 
   rm_child(pmip, base_name);
-  pmip->dirty = 1;
+  idirty(pmip);
   iput(pmip);
 
   mip->INODE.i_links_count--;
-  if (mip->INODE.i_links_count > 0) {
-    mip->dirty = 1;
-    iput(mip);
-  }
-
-  if (!(mip->INODE.i_mode & EXT2_S_IFLNK)) {
-    truncat(mip);
-    idealloc(dev, ino);
-    iput(mip);
+  idirty(mip);
+  if (mip->INODE.i_links_count == 0) {
+    // the blocks are freed later, a batch at a time, see orphan.c
+    orphan_add(mip);
   }
+  iput(mip);
 }
 
 void loc_symlink(char *old_name, char *new_name) {
-  char old_name_buf[256];
-  char new_name_buf[256];
-
-  strcpy(old_name_buf, old_name);
-
-  int dev = path_start_dev(old_name);
+  int dev;
+  char base_name[EXT2_NAME_LEN + 1];
+  int parent_inode;
 
-  strcpy(old_name_buf, old_name);
-  strcpy(new_name_buf, new_name);
-  struct stat s = loc_stat(old_name_buf);
-  if (s.st_ino == 0) {
+  if (getino(&dev, old_name) == 0) {
     err("failed ino");
     return;
-  } else if (getino(&dev, new_name_buf) != 0) {
+  } else if (getino(&dev, new_name) != 0) {
     err("already exists");
     return;
+  } else if (strlen(old_name) >= 15 * sizeof(uint32_t)) {
+    err("link target too long");
+    return;
+  } else if ((parent_inode = getino_parent(&dev, new_name, base_name)) == 0) {
+    err("cannot create link");
+    return;
   }
 
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, new_name);
-  strcpy(base_buf, new_name);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
-
-  int parent_inode = getino(&dev, dir_name);
   MINODE *pmip = iget(dev, parent_inode);
 
-  int ino = ialloc(dev);
+  int ino = ialloc(dev, pmip->ino, 0);
+  if (!ino) {
+    err("no free inodes");
+    iput(pmip);
+    return;
+  }
   MINODE *mip = iget(dev, ino);
+  memset(&mip->INODE, 0, sizeof(INODE));  // may be a reused inode
+  bmap_inval(mip);
 
   time_t now = time(0);
   mip->INODE.i_mode =
       EXT2_S_IFLNK | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IRGRP | EXT2_S_IROTH;
   mip->INODE.i_blocks = 0;
-  mip->INODE.i_size = 0;
+  mip->INODE.i_size = strlen(old_name);  // fast symlink, target in i_block
   mip->INODE.i_uid = running->uid;
   mip->INODE.i_gid = running->gid;
   mip->INODE.i_links_count = 1;
@@ -805,40 +1077,40 @@ void loc_symlink(char *old_name, char *new_name) {
 
   memset(mip->INODE.i_block, 0, 15 * sizeof(uint32_t));
   memcpy(mip->INODE.i_block, old_name, strlen(old_name));
-  mip->dirty = 1;
-  iput(mip);
+  idirty(mip);
 
-  enter_child(pmip, ino, base_name, EXT2_FT_SYMLINK);
-  pmip->dirty = 1;
+  if (enter_child(pmip, ino, base_name, EXT2_FT_SYMLINK)) {
+    iput(mip);
+  } else {
+    discard_new(mip);
+  }
+  idirty(pmip);
   iput(pmip);
 }
 
 size_t loc_readlink(char *pathname, uint32_t buf[15]) {
-  char pathname_buf[256] = {0};
-
-  strcpy(pathname_buf, pathname);
-
-  int dev = path_start_dev(pathname);
-  int ino = getino(&dev, pathname_buf);
-  MINODE *mip = iget(dev, ino);
-
-  strcpy(pathname_buf, pathname);
-  struct stat s = loc_stat(pathname_buf);
-  if (s.st_ino == 0) {
+  int dev;
+  int ino = getino(&dev, pathname);
+  if (ino == 0) {
     err("does not exist");
     return 0;
-  } else if ((s.st_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK) {
+  }
+  MINODE *mip = iget(dev, ino);
+
+  if ((mip->INODE.i_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK) {
     err("is NOT SLINK");
+    iput(mip);
     return 0;
   }
 
   memcpy(buf, mip->INODE.i_block, 15 * sizeof(uint32_t));
+  iput(mip);
   return strlen((char *)buf);
 }
 
 void cd(char *path) {
-  int dev = path_start_dev(path);
-  int ino = getino(&dev, !path ? "/" : path);
+  int dev;
+  int ino = getino(&dev, !path || !*path ? "/" : path);
 
   if (ino == 0) {
     err("directory does not exist");
@@ -849,24 +1121,23 @@ void cd(char *path) {
   if ((mi->INODE.i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
     uint32_t link_buf[15] = {0};
     loc_readlink(path, link_buf);
-    int ino = getino(&mi->dev, (char *)link_buf);
-    mi = iget(mi->dev, ino);
+    int link_dev;
+    int ino = getino(&link_dev, (char *)link_buf);
+    iput(mi);
+    mi = iget(link_dev, ino);
   } else if ((mi->INODE.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
     err("not a directory");
+    iput(mi);
     return;
   }
 
+  iput(running->cwd);
   running->cwd = mi;
 }
 
-void ls_file(char *fname) {
+static void ls_stat(struct stat *sp, char *name) {
   static char *t1 = "xwrxwrxwr-------";
   static char *t2 = "----------------";
-  static char name_buf[256];
-
-  strcpy(name_buf, fname);
-  struct stat s = loc_stat(name_buf);
-  struct stat *sp = &s;
 
   int i, is_dir = 0;
   char ftime[64] = {0};
@@ -888,7 +1159,7 @@ void ls_file(char *fname) {
   printf("%4d ", (int)sp->st_nlink);
   printf("%4d ", sp->st_gid);
   printf("%4d ", sp->st_uid);
-  printf("%8d ", (int)sp->st_size);
+  printf("%8lld ", (long long)sp->st_size);
 
   // print time
   strcpy(ftime, ctime(&sp->st_mtim.tv_sec));
@@ -897,18 +1168,28 @@ void ls_file(char *fname) {
 
   // print name
   char *col = is_dir ? BLUE_COL : PURPLE_COL;
-  printf("%s%s%s%s", col, basename(fname), REG_COL, (is_dir ? "/" : ""));
+  printf("%s%s%s%s", col, name, REG_COL, (is_dir ? "/" : ""));
+}
+
+void ls_file(const char *fname) {
+  char name[EXT2_NAME_LEN + 1];
+  size_t len, dir_len;
+  const char *base = path_base(fname, &len, &dir_len);
+
+  if (len > EXT2_NAME_LEN) len = EXT2_NAME_LEN;
+  memcpy(name, base, len);
+  name[len] = '\0';
+
+  struct stat s = loc_stat(fname);
+  ls_stat(&s, name);
 }
 
 void ls(char *path) {
-  char path_buf[256];
   char name[256];
   MINODE *minode;
-  int dev = path_start_dev(path);
+  int dev = running->cwd->dev;
   int is_dir = 0;
 
-  strcpy(path_buf, path);
-
   if (strcmp(path, "") == 0) {
     minode = running->cwd;
   } else {
@@ -921,8 +1202,9 @@ void ls(char *path) {
 
     if ((minode->INODE.i_mode & EXT2_S_IFREG) == EXT2_S_IFREG ||
         (minode->INODE.i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
-      ls_file(path_buf);
+      ls_file(path);
       putchar('\n');
+      iput(minode);
       return;
     }
 
@@ -931,83 +1213,62 @@ void ls(char *path) {
     }
   }
 
-  struct ext2_dir_entry_2 *de = get_block(dev, minode->INODE.i_block[0]),
-                          *end = (struct ext2_dir_entry_2 *)((uint8_t *)de +
-                                                             BLKSIZE);
-
-  static char full_path[256];
+  char full_path[strlen(path) + 1 + EXT2_NAME_LEN + 1];
 
-  while (de != end) {
+  struct dir_iter it;
+  struct ext2_dir_entry_2 *de;
+  dir_iter_start(&it, minode);
+  while ((de = dir_iter_next(&it))) {
     memcpy(name, de->name, de->name_len);
     name[de->name_len] = '\0';
 
-    sprintf(full_path, "%s/%s", path_buf, name);
-    if (is_dir) {
-      ls_file(full_path);
+    MINODE *mi = iget(dev, de->inode);
+
+    // .. and mount points go through the path so they show the other side
+    if (mi->mounted || strcmp(name, "..") == 0) {
+      snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
+      ls_file(is_dir ? full_path : name);
     } else {
-      ls_file(name);
+      struct stat s = minode_stat(mi);
+      ls_stat(&s, name);
     }
 
-    MINODE *mi = iget(dev, de->inode);
-    if ((mi->INODE.i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
-      uint32_t link_buf[15];
-      loc_readlink(full_path, link_buf);
-      printf(" -> %s%s%s", CYAN_COL, (char *)link_buf, REG_COL);
+    if ((mi->INODE.i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK) {
+      char link_buf[sizeof(mi->INODE.i_block) + 1] = {0};
+      memcpy(link_buf, mi->INODE.i_block, sizeof(mi->INODE.i_block));
+      printf(" -> %s%s%s", CYAN_COL, link_buf, REG_COL);
     }
+    iput(mi);
     putchar('\n');
-    de = (struct ext2_dir_entry_2 *)((uint8_t *)de + de->rec_len);
   }
+  dir_iter_end(&it);
+  if (minode != running->cwd) iput(minode);
 }
 
 void loc_rm(char *path) {
-  int dev = path[0] == '/' ? root->dev : running->cwd->dev;
-
-  char path_cpy[256];
-  strcpy(path_cpy, path);
-
-  int ino = getino(&dev, path_cpy);
+  int dev;
+  int ino = getino(&dev, path);
+  if (ino == 0) {
+    err("Cannot delete...");
+    return;
+  }
   MINODE *mip = iget(dev, ino);
 
-  char dir_buf[256];
-  char base_buf[256];
-  strcpy(dir_buf, path);
-  strcpy(base_buf, path);
-
-  char *dir_name, *base_name;
-  dir_name = dirname(dir_buf);
-  base_name = basename(base_buf);
-  strcpy(path_cpy, path);
-  struct stat s = loc_stat(path_cpy);
-  if ((s.st_ino == 0) || (s.st_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
+  uint16_t mode = mip->INODE.i_mode;
+  if ((mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
     err("Cannot delete...");
+    iput(mip);
     return;
   }
 
   if (!check_permissions(mip)) {
     err("insufficient permissions");
+    iput(mip);
     return;
   }
 
-  if (s.st_mode & EXT2_S_IFLNK) {
-    strcpy(path_cpy, path);
-    loc_unlink(path_cpy);
-    return;
-  }
-
-  int parent_inode = getino(&dev, dir_name);
-  MINODE *pmip = iget(dev, parent_inode);
-
-  if ((pmip->INODE.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR)
-    return;  // check pmip is a dir
-
-  rm_child(pmip, base_name);
-
-  truncat(mip);
-  idealloc(dev, ino);
   iput(mip);
-  pmip->INODE.i_links_count--;
-  pmip->dirty = 1;
-  iput(pmip);
+  loc_unlink(path);
 }
 
 void pfd(void) {
@@ -1019,18 +1280,22 @@ void pfd(void) {
 }
 
 void loc_chmod(char *mode, char *pathname) {
-  int dev = path_start_dev(pathname);
+  int dev;
   int ino = getino(&dev, pathname);
+  if (ino == 0) {
+    err("file does not exist");
+    return;
+  }
   MINODE *mip = iget(dev, ino);
   int newmode = 0;
   sscanf(mode, "%o", &newmode);
   mip->INODE.i_mode = (mip->INODE.i_mode & 0xF000) | (newmode & 0x0FFF);
-  mip->dirty = 1;
+  idirty(mip);
   iput(mip);
 }
 
 void loc_touch(char *pathname) {
-  int dev = path_start_dev(pathname);
+  int dev;
   int ino = getino(&dev, pathname);
   if (ino == 0) {
     err("file does not exist");
@@ -1038,7 +1303,7 @@ void loc_touch(char *pathname) {
   }
   MINODE *mip = iget(dev, ino);
   mip->INODE.i_mtime = time(0L);
-  mip->dirty = 1;
+  idirty(mip);
   iput(mip);
 }
 
@@ -1057,10 +1322,38 @@ void list_proc(void) {
   }
 }
 
-void quit() {
-  for (int i = 0; i < NMINODE; i++) {
-    if (minode[i].ino != 0) iput(&minode[i]);
+void diagnostic(void) {
+  printf("block cache: %lu hits, %lu misses, %lu reads, %lu writes\n",
+         bstats.hits, bstats.misses, bstats.reads, bstats.writes);
+  printf("readahead: %lu blocks read ahead, %lu hits\n", bstats.ra_blocks,
+         bstats.ra_hits);
+  icache_print();
+  dcache_print();
+  printf("block map: %lu hits, %lu misses\n", bmstats.hits, bmstats.misses);
+  printf("delayed allocation: %lu pages, %lu flushes, %lu extents\n",
+         dastats.pages, dastats.flushes, dastats.extents);
+  int orphans = 0;
+  for (int i = 0; i < nmounts; i++) orphans += mount_tbl[i]->norphans;
+  printf("orphans: %d waiting, %lu queued, %lu reclaimed, %lu blocks freed\n",
+         orphans, ostats.queued, ostats.reclaimed, ostats.blocks);
+
+  printf("async io (%s): %lu submitted, %d at most in flight, %lu waits\n",
+         aio_backend_name(aio_get_backend()), aiostats.submitted,
+         aiostats.max_inflight, aiostats.waits);
+  printf("journal: %lu commits, %lu blocks logged, %lu replayed, %lu "
+         "barriers, %lu forced commits\n",
+         jstats.commits, jstats.blocks, jstats.replayed, bstats.barriers,
+         bstats.forced);
+
+  for (int i = 0; i < nmounts; i++) {
+    printf("%s: %lu superblock writes\n", mount_tbl[i]->name,
+           mount_tbl[i]->super_writes);
   }
+}
+
+void quit() {
+  orphan_drain(-1);
+  iput_all();
   write_mnt_entries();
   sync();
   exit(0);
@@ -1071,7 +1364,7 @@ void init_procs(void) {
     proc[i].uid = i;
     proc[i].pid = i;
     proc[i].gid = i;
-    proc[i].cwd = root;
+    proc[i].cwd = iget(root->dev, root->ino);
   }
 
   // make proc 0 and proc 1 have the same gid to test perms
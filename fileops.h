@@ -6,23 +6,37 @@
 #include "type.h"
 
 void init(void);
-void mount_root(const char *fname);
+void mount_root(const char *fname, int use_mmap);
 void cd(char *path);
 void ls(char *path);
 
-int getino(int *d, char *path);
+int getino(int *d, const char *path);
+int getino_parent(int *d, const char *path, char base[EXT2_NAME_LEN + 1]);
+uint32_t search_dir(const char *fname, size_t fname_len, uint32_t dir_inode,
+                    int *dev);
+int enter_child(MINODE *parent, int ino, char *basename, uint8_t file_type);
+int rm_child(MINODE *parent, char *name);
+void kmkdir(MINODE *pmip, char *base_name);
+void krmdir(MINODE *pmip, MINODE *mip, char *base_name);
 MINODE *iget(int dev, int ino);
 void iput(MINODE *mip);
+void iput_all(void);
+void idirty(MINODE *mip);
+int iflush(struct mntable *me);
+void iflush_expired(void);
+void iinval(int dev);
+int ibusy(int dev, int skip);
+void set_minode_capacity(int capacity);
+void icache_print(void);
 
 void switch_proc(int proc_num);
 void list_proc(void);
 void init_procs(void);
 
 void pfd(void);
-int path_start_dev(char *path);
 
 size_t loc_readlink(char *pathname, uint32_t buf[15]);
-struct stat loc_stat(char *path);
+struct stat loc_stat(const char *path);
 char *pwd(char *out_path);
 void loc_link(char *old_name, char *new_name);
 
@@ -38,7 +52,7 @@ void loc_unlink(char *pathname);
 void loc_symlink(char *old_name, char *new_name);
 size_t loc_readlink(char *pathname, uint32_t buf[15]);
 
-struct stat loc_stat(char *path);
+struct stat loc_stat(const char *path);
 void diagnostic(void);
 void quit();
 
@@ -0,0 +1,635 @@
+#include <ext2fs/ext2_fs.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "fileio.h"
+#include "fileops.h"
+#include "htree.h"
+#include "type.h"
+
+// ext2/3 hashed directories: block 0 holds . and .. followed by the dx root,
+// interior nodes are blocks with a single empty record, and leaves are
+// ordinary directory blocks. Non-htree code sees every index block as free
+// space, which is what keeps the format backward compatible.
+
+#define DX_ROOT_INFO_OFF 24  // after "." (12 bytes) and the ".." header
+#define DX_NODE_OFF 8        // after the fake empty record
+#define DX_ROOT_LIMIT ((BLKSIZE - DX_ROOT_INFO_OFF - 8) / 8)
+#define DX_NODE_LIMIT ((BLKSIZE - DX_NODE_OFF) / 8)
+#define DX_MAX_LEVELS 2  // root plus one level of interior nodes
+
+#define DE_AT(data, off) \
+  ((struct ext2_dir_entry_2 *)((uint8_t *)(data) + (off)))
+
+// ---- name hashes, bit for bit what e2fsprogs and the kernel compute ----
+
+#define TEA_DELTA 0x9E3779B9
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+  uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+  uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+  for (int n = 0; n < 16; n++) {
+    sum += TEA_DELTA;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  }
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) \
+  (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  ROUND(F, a, b, c, d, in[0] + K1, 3);
+  ROUND(F, d, a, b, c, in[1] + K1, 7);
+  ROUND(F, c, d, a, b, in[2] + K1, 11);
+  ROUND(F, b, c, d, a, in[3] + K1, 19);
+  ROUND(F, a, b, c, d, in[4] + K1, 3);
+  ROUND(F, d, a, b, c, in[5] + K1, 7);
+  ROUND(F, c, d, a, b, in[6] + K1, 11);
+  ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+  ROUND(G, a, b, c, d, in[1] + K2, 3);
+  ROUND(G, d, a, b, c, in[3] + K2, 5);
+  ROUND(G, c, d, a, b, in[5] + K2, 9);
+  ROUND(G, b, c, d, a, in[7] + K2, 13);
+  ROUND(G, a, b, c, d, in[0] + K2, 3);
+  ROUND(G, d, a, b, c, in[2] + K2, 5);
+  ROUND(G, c, d, a, b, in[4] + K2, 9);
+  ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+  ROUND(H, a, b, c, d, in[3] + K3, 3);
+  ROUND(H, d, a, b, c, in[7] + K3, 9);
+  ROUND(H, c, d, a, b, in[2] + K3, 11);
+  ROUND(H, b, c, d, a, in[6] + K3, 15);
+  ROUND(H, a, b, c, d, in[1] + K3, 3);
+  ROUND(H, d, a, b, c, in[5] + K3, 9);
+  ROUND(H, c, d, a, b, in[0] + K3, 11);
+  ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+static uint32_t legacy_hash(const char *name, int len, int unsigned_chars) {
+  uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+  while (len--) {
+    int c = unsigned_chars ? (int)(unsigned char)*name
+                           : (int)(signed char)*name;
+    name++;
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000) hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num,
+                        int unsigned_chars) {
+  uint32_t pad = (uint32_t)len | ((uint32_t)len << 8), val;
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4) len = num * 4;
+  for (int i = 0; i < len; i++) {
+    int c = unsigned_chars ? (int)(unsigned char)msg[i]
+                           : (int)(signed char)msg[i];
+    val = c + (val << 8);
+    if (i % 4 == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0) *buf++ = val;
+  while (--num >= 0) *buf++ = pad;
+}
+
+uint32_t dx_hash(int version, const char *name, int len,
+                 const uint32_t seed[4]) {
+  uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint32_t in[8], hash;
+  int unsigned_chars = version >= EXT2_HASH_LEGACY_UNSIGNED;
+
+  if (seed && (seed[0] | seed[1] | seed[2] | seed[3])) {
+    memcpy(buf, seed, sizeof(buf));
+  }
+
+  switch (version) {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+      hash = legacy_hash(name, len, unsigned_chars);
+      break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+      for (; len > 0; len -= 16, name += 16) {
+        str2hashbuf(name, len, in, 4, unsigned_chars);
+        tea_transform(buf, in);
+      }
+      hash = buf[0];
+      break;
+    default:  // half md4
+      for (; len > 0; len -= 32, name += 32) {
+        str2hashbuf(name, len, in, 8, unsigned_chars);
+        half_md4_transform(buf, in);
+      }
+      hash = buf[1];
+      break;
+  }
+  return hash & ~1;
+}
+
+// ---- index walking ----
+
+struct dx_frame {
+  struct buf *bp;
+  struct ext2_dx_entry *entries, *at;
+};
+
+// the count/limit pair overlays the hash of entries[0], whose hash is
+// implicitly the lowest the block covers
+static struct ext2_dx_countlimit *dx_cl(struct ext2_dx_entry *entries) {
+  return (struct ext2_dx_countlimit *)entries;
+}
+
+static struct ext2_dx_root_info *dx_info(struct buf *bp) {
+  return (struct ext2_dx_root_info *)(bp->data + DX_ROOT_INFO_OFF);
+}
+
+int dx_supported(struct mntable *me) {
+  return (me->super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+}
+
+int dx_indexed(MINODE *dir) {
+  return (dir->INODE.i_flags & EXT2_INDEX_FL) && dx_supported(dir->mptr);
+}
+
+static int dx_version(MINODE *dir, int root_version) {
+  if (root_version <= EXT2_HASH_TEA &&
+      (dir->mptr->super.s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+    return root_version + 3;
+  }
+  return root_version;
+}
+
+static void dx_release(struct dx_frame *frames, int n) {
+  for (int i = 0; i < n; i++) brelse(frames[i].bp);
+}
+
+// walk from the root to the leaf covering name's hash, leaving every level
+// pinned in frames. Returns the depth, or 0 if the index can't be trusted
+static int dx_probe(MINODE *dir, const char *name, int len,
+                    struct dx_frame *frames, uint32_t *hash) {
+  int nblks = dir->INODE.i_size / BLKSIZE;
+  struct buf *bp = bread(dir->dev, bmap(dir, 0));
+  struct ext2_dx_root_info *info = dx_info(bp);
+
+  if (info->reserved_zero || info->info_length != 8 ||
+      info->indirect_levels >= DX_MAX_LEVELS ||
+      info->hash_version > EXT2_HASH_TEA) {
+    brelse(bp);
+    return 0;
+  }
+  *hash = dx_hash(dx_version(dir, info->hash_version), name, len,
+                  dir->mptr->super.s_hash_seed);
+
+  int levels = info->indirect_levels;
+  struct ext2_dx_entry *entries =
+      (struct ext2_dx_entry *)((uint8_t *)info + info->info_length);
+
+  for (int level = 0;; level++) {
+    struct ext2_dx_countlimit *cl = dx_cl(entries);
+    if (cl->count == 0 || cl->count > cl->limit ||
+        cl->limit != (level ? DX_NODE_LIMIT : DX_ROOT_LIMIT)) {
+      dx_release(frames, level);
+      brelse(bp);
+      return 0;
+    }
+
+    // last entry whose hash is <= *hash
+    struct ext2_dx_entry *p = entries + 1, *q = entries + cl->count - 1;
+    while (p <= q) {
+      struct ext2_dx_entry *m = p + (q - p) / 2;
+      if (m->hash > *hash) {
+        q = m - 1;
+      } else {
+        p = m + 1;
+      }
+    }
+
+    frames[level].bp = bp;
+    frames[level].entries = entries;
+    frames[level].at = p - 1;
+
+    if (frames[level].at->block == 0 ||
+        frames[level].at->block >= (uint32_t)nblks) {
+      dx_release(frames, level + 1);
+      return 0;
+    }
+    if (level == levels) return level + 1;
+
+    bp = bread(dir->dev, bmap(dir, frames[level].at->block));
+    entries = (struct ext2_dx_entry *)(bp->data + DX_NODE_OFF);
+  }
+}
+
+// move to the next leaf when hash's run of entries spills over into it
+static int dx_next_leaf(MINODE *dir, struct dx_frame *frames, int n,
+                        uint32_t hash) {
+  int level = n - 1;
+  while (level >= 0 && frames[level].at + 1 >= frames[level].entries +
+                                                   dx_cl(frames[level].entries)
+                                                       ->count) {
+    level--;
+  }
+  if (level < 0 || ((frames[level].at + 1)->hash & ~1) != hash) return 0;
+
+  frames[level].at++;
+  for (level++; level < n; level++) {
+    brelse(frames[level].bp);
+    frames[level].bp = bread(dir->dev, bmap(dir, frames[level - 1].at->block));
+    frames[level].entries =
+        (struct ext2_dx_entry *)(frames[level].bp->data + DX_NODE_OFF);
+    frames[level].at = frames[level].entries;
+  }
+  return 1;
+}
+
+// put (hash, block) right after f->at
+static void dx_insert(struct dx_frame *f, uint32_t hash, uint32_t block) {
+  struct ext2_dx_countlimit *cl = dx_cl(f->entries);
+  struct ext2_dx_entry *new = f->at + 1, *end = f->entries + cl->count;
+
+  memmove(new + 1, new, (end - new) * sizeof(*new));
+  new->hash = hash;
+  new->block = block;
+  cl->count++;
+  bdirty(f->bp);
+}
+
+// append an empty block to the directory, returned pinned and zeroed
+static struct buf *dx_new_block(MINODE *dir, uint32_t *lbk) {
+  *lbk = dir->INODE.i_size / BLKSIZE;
+  alloc_blocks(dir, *lbk, 1);
+
+  int blk = bmap(dir, *lbk);
+  if (!blk) return NULL;
+
+  struct buf *bp = bgetblk(dir->dev, blk);
+  memset(bp->data, 0, BLKSIZE);
+  DE_AT(bp->data, 0)->rec_len = BLKSIZE;
+  bdirty(bp);
+
+  dir->INODE.i_size += BLKSIZE;
+  idirty(dir);
+  return bp;
+}
+
+// ---- leaf blocks ----
+
+struct dx_map {
+  uint32_t hash;
+  uint16_t off, len;
+};
+
+static int cmp_map(const void *a, const void *b) {
+  const struct dx_map *x = a, *y = b;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  return x->off - y->off;
+}
+
+// live records of data from offset start on; hashed when version >= 0
+static int leaf_map(MINODE *dir, uint8_t *data, int start, int version,
+                    struct dx_map *map) {
+  int n = 0;
+  for (int off = start; off + 8 <= BLKSIZE;) {
+    struct ext2_dir_entry_2 *de = DE_AT(data, off);
+    if (de->rec_len < 8 || off + de->rec_len > BLKSIZE) break;
+
+    if (de->inode) {
+      map[n].hash = version < 0 ? 0
+                                : dx_hash(version, de->name, de->name_len,
+                                          dir->mptr->super.s_hash_seed);
+      map[n].off = off;
+      map[n].len = EXT2_DIR_REC_LEN(de->name_len);
+      n++;
+    }
+    off += de->rec_len;
+  }
+  return n;
+}
+
+// lay the mapped records of src out back to back in dst
+static void leaf_pack(uint8_t *dst, uint8_t *src, struct dx_map *map, int n) {
+  struct ext2_dir_entry_2 *de = NULL;
+  int off = 0;
+
+  memset(dst, 0, BLKSIZE);
+  for (int i = 0; i < n; i++) {
+    de = DE_AT(dst, off);
+    memcpy(de, src + map[i].off, map[i].len);
+    de->rec_len = map[i].len;
+    off += map[i].len;
+  }
+  if (de) {
+    de->rec_len += BLKSIZE - off;
+  } else {
+    DE_AT(dst, 0)->rec_len = BLKSIZE;
+  }
+}
+
+static struct ext2_dir_entry_2 *leaf_find(struct buf *bp, const char *name,
+                                          int len,
+                                          struct ext2_dir_entry_2 **prev) {
+  *prev = NULL;
+  for (int off = 0; off + 8 <= BLKSIZE;) {
+    struct ext2_dir_entry_2 *de = DE_AT(bp->data, off);
+    if (de->rec_len < 8 || off + de->rec_len > BLKSIZE) break;
+
+    if (de->inode && de->name_len == len && memcmp(de->name, name, len) == 0) {
+      return de;
+    }
+    *prev = de;
+    off += de->rec_len;
+  }
+  return NULL;
+}
+
+static int leaf_insert(struct buf *bp, const char *name, int len, int ino,
+                       uint8_t file_type) {
+  int need = EXT2_DIR_REC_LEN(len);
+
+  for (int off = 0; off + 8 <= BLKSIZE;) {
+    struct ext2_dir_entry_2 *de = DE_AT(bp->data, off);
+    if (de->rec_len < 8 || off + de->rec_len > BLKSIZE) break;
+
+    int used = de->inode ? EXT2_DIR_REC_LEN(de->name_len) : 0;
+    if (de->rec_len - used >= need) {
+      struct ext2_dir_entry_2 *new = DE_AT(de, used);
+      if (used) {
+        new->rec_len = de->rec_len - used;
+        de->rec_len = used;
+      }
+      new->inode = ino;
+      new->name_len = len;
+      new->file_type = file_type;
+      memcpy(new->name, name, len);
+      bdirty(bp);
+      return 1;
+    }
+    off += de->rec_len;
+  }
+  return 0;
+}
+
+// split the leaf under f->at in two by hash, indexing the upper half after
+// it. Returns whichever half hash now belongs to, pinned
+static struct buf *dx_split_leaf(MINODE *dir, struct dx_frame *f,
+                                 uint32_t hash, int version) {
+  static struct dx_map map[BLKSIZE / 12];
+  static uint8_t tmp[BLKSIZE];
+
+  struct buf *bp = bread(dir->dev, bmap(dir, f->at->block));
+  int n = leaf_map(dir, bp->data, 0, version, map);
+  if (n < 2) return bp;
+  qsort(map, n, sizeof(*map), cmp_map);
+
+  int split = n / 2;
+  uint32_t hash2 = map[split].hash;
+  int continued = hash2 == map[split - 1].hash;
+
+  uint32_t lbk;
+  struct buf *nbp = dx_new_block(dir, &lbk);
+  if (!nbp) {
+    brelse(bp);
+    return NULL;
+  }
+
+  memcpy(tmp, bp->data, BLKSIZE);
+  leaf_pack(nbp->data, tmp, map + split, n - split);
+  leaf_pack(bp->data, tmp, map, split);
+  bdirty(bp);
+  bdirty(nbp);
+
+  // a run of equal hashes cut in two is flagged so lookups keep going
+  dx_insert(f, hash2 | continued, lbk);
+
+  if (hash >= hash2) {
+    brelse(bp);
+    return nbp;
+  }
+  brelse(nbp);
+  return bp;
+}
+
+// make room for one more entry in the deepest index block, adding a level
+// or splitting an interior node. Returns 0 when the tree is at its limit
+static int dx_grow_index(MINODE *dir, struct dx_frame *frames, int *n) {
+  struct dx_frame *f = &frames[*n - 1];
+  struct ext2_dx_countlimit *cl = dx_cl(f->entries);
+  if (cl->count < cl->limit) return 1;
+
+  uint32_t lbk;
+  struct buf *nbp;
+
+  if (*n == 1) {
+    if (!(nbp = dx_new_block(dir, &lbk))) return 0;
+
+    // push the whole root down into a new node under a single root entry
+    struct ext2_dx_entry *node =
+        (struct ext2_dx_entry *)(nbp->data + DX_NODE_OFF);
+    memcpy(node, f->entries, cl->count * sizeof(*node));
+    dx_cl(node)->limit = DX_NODE_LIMIT;
+    bdirty(nbp);
+
+    cl->count = 1;
+    f->entries[0].block = lbk;
+    dx_info(f->bp)->indirect_levels = 1;
+    bdirty(f->bp);
+
+    frames[1].bp = nbp;
+    frames[1].entries = node;
+    frames[1].at = node + (f->at - f->entries);
+    f->at = f->entries;
+    *n = 2;
+    return 1;
+  }
+
+  // split a full interior node, if the root can index one more
+  struct dx_frame *root = &frames[0];
+  struct ext2_dx_countlimit *root_cl = dx_cl(root->entries);
+  if (root_cl->count >= root_cl->limit || !(nbp = dx_new_block(dir, &lbk))) {
+    return 0;
+  }
+
+  int count = cl->count, half = count / 2;
+  uint32_t hash2 = f->entries[half].hash;
+  struct ext2_dx_entry *node =
+      (struct ext2_dx_entry *)(nbp->data + DX_NODE_OFF);
+
+  memcpy(node, f->entries + half, (count - half) * sizeof(*node));
+  dx_cl(node)->limit = DX_NODE_LIMIT;
+  dx_cl(node)->count = count - half;
+  cl->count = half;
+  bdirty(nbp);
+  bdirty(f->bp);
+
+  dx_insert(root, hash2, lbk);
+
+  if (f->at >= f->entries + half) {
+    brelse(f->bp);
+    f->bp = nbp;
+    f->at = node + (f->at - (f->entries + half));
+    f->entries = node;
+    root->at++;
+  } else {
+    brelse(nbp);
+  }
+  return 1;
+}
+
+// an index we can't follow is dropped: the directory stays valid as a
+// plain linear one since every index block reads as empty space
+static int dx_drop(MINODE *dir) {
+  dir->INODE.i_flags &= ~EXT2_INDEX_FL;
+  idirty(dir);
+  return -1;
+}
+
+// ---- entry points ----
+
+int dx_lookup(MINODE *dir, const char *name, int len, uint32_t *ino) {
+  struct dx_frame frames[DX_MAX_LEVELS];
+  uint32_t hash;
+  int n = dx_probe(dir, name, len, frames, &hash);
+  if (!n) return dx_drop(dir);
+
+  *ino = 0;
+  do {
+    struct ext2_dir_entry_2 *de, *prev;
+    struct buf *bp = bread(dir->dev, bmap(dir, frames[n - 1].at->block));
+    if ((de = leaf_find(bp, name, len, &prev))) *ino = de->inode;
+    brelse(bp);
+  } while (!*ino && dx_next_leaf(dir, frames, n, hash));
+
+  dx_release(frames, n);
+  return *ino != 0;
+}
+
+int dx_add(MINODE *dir, const char *name, int len, int ino,
+           uint8_t file_type) {
+  struct dx_frame frames[DX_MAX_LEVELS];
+  uint32_t hash;
+  int n = dx_probe(dir, name, len, frames, &hash);
+  if (!n) return dx_drop(dir);
+
+  int added = 0;
+  struct buf *bp = bread(dir->dev, bmap(dir, frames[n - 1].at->block));
+  if (leaf_insert(bp, name, len, ino, file_type)) {
+    added = 1;
+  } else {
+    brelse(bp);
+    bp = NULL;
+
+    int version = dx_version(dir, dx_info(frames[0].bp)->hash_version);
+    if (dx_grow_index(dir, frames, &n) &&
+        (bp = dx_split_leaf(dir, &frames[n - 1], hash, version))) {
+      added = leaf_insert(bp, name, len, ino, file_type);
+    }
+  }
+
+  if (bp) brelse(bp);
+  dx_release(frames, n);
+  return added;
+}
+
+int dx_remove(MINODE *dir, const char *name, int len) {
+  struct dx_frame frames[DX_MAX_LEVELS];
+  uint32_t hash;
+  int n = dx_probe(dir, name, len, frames, &hash);
+  if (!n) return dx_drop(dir);
+
+  int removed = 0;
+  do {
+    struct ext2_dir_entry_2 *de, *prev;
+    struct buf *bp = bread(dir->dev, bmap(dir, frames[n - 1].at->block));
+    if ((de = leaf_find(bp, name, len, &prev))) {
+      if (prev) {
+        prev->rec_len += de->rec_len;
+      } else {
+        de->inode = 0;
+      }
+      bdirty(bp);
+      removed = 1;
+    }
+    brelse(bp);
+  } while (!removed && dx_next_leaf(dir, frames, n, hash));
+
+  dx_release(frames, n);
+  return removed;
+}
+
+// index a full single-block directory: everything after . and .. moves to a
+// new leaf and the rest of block 0 becomes the root. Only done for the
+// layout kmkdir writes
+int dx_make_indexed(MINODE *dir) {
+  static struct dx_map map[BLKSIZE / 12];
+
+  if (!dx_supported(dir->mptr) || dir->INODE.i_size != BLKSIZE) return 0;
+
+  struct buf *bp = bread(dir->dev, bmap(dir, 0));
+  struct ext2_dir_entry_2 *dot = DE_AT(bp->data, 0), *dotdot = DE_AT(dot, 12);
+  if (dot->rec_len != 12 || dotdot->name_len != 2 ||
+      memcmp(dotdot->name, "..", 2) != 0 || dotdot->rec_len < 12) {
+    brelse(bp);
+    return 0;
+  }
+
+  uint32_t lbk;
+  struct buf *leaf = dx_new_block(dir, &lbk);
+  if (!leaf) {
+    brelse(bp);
+    return 0;
+  }
+
+  int n = leaf_map(dir, bp->data, 12 + dotdot->rec_len, -1, map);
+  leaf_pack(leaf->data, bp->data, map, n);
+  bdirty(leaf);
+  brelse(leaf);
+
+  dotdot->rec_len = BLKSIZE - 12;
+  memset(bp->data + DX_ROOT_INFO_OFF, 0, BLKSIZE - DX_ROOT_INFO_OFF);
+
+  struct ext2_dx_root_info *info = dx_info(bp);
+  info->info_length = 8;
+  info->hash_version = dir->mptr->super.s_def_hash_version <= EXT2_HASH_TEA
+                           ? dir->mptr->super.s_def_hash_version
+                           : EXT2_HASH_HALF_MD4;
+
+  struct ext2_dx_entry *entries =
+      (struct ext2_dx_entry *)((uint8_t *)info + info->info_length);
+  dx_cl(entries)->limit = DX_ROOT_LIMIT;
+  dx_cl(entries)->count = 1;
+  entries[0].block = lbk;
+  bdirty(bp);
+  brelse(bp);
+
+  dir->INODE.i_flags |= EXT2_INDEX_FL;
+  idirty(dir);
+  return 1;
+}
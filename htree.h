@@ -0,0 +1,21 @@
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <stdint.h>
+
+#include "type.h"
+
+int dx_supported(struct mntable *me);
+int dx_indexed(MINODE *dir);
+uint32_t dx_hash(int version, const char *name, int len,
+                 const uint32_t seed[4]);
+
+// each returns -1 when dir has no usable index and the caller must fall
+// back to a linear scan (a damaged index is dropped so that stays safe)
+int dx_lookup(MINODE *dir, const char *name, int len, uint32_t *ino);
+int dx_add(MINODE *dir, const char *name, int len, int ino, uint8_t file_type);
+int dx_remove(MINODE *dir, const char *name, int len);
+
+int dx_make_indexed(MINODE *dir);
+
+#endif
@@ -0,0 +1,518 @@
+#include <assert.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "fileio.h"
+#include "fileops.h"
+#include "journal.h"
+#include "mount.h"
+#include "type.h"
+#include "util.h"
+
+extern struct mntable **mount_tbl;
+extern int nmounts;
+
+struct journal_stats jstats;
+
+// the on-disk format is JBD's, every field big-endian
+#define JBD_MAGIC 0xc03b3998
+
+#define JBD_DESCRIPTOR 1
+#define JBD_COMMIT 2
+#define JBD_SUPER_V1 3
+#define JBD_SUPER_V2 4
+#define JBD_REVOKE 5
+
+#define JBD_FLAG_ESCAPE 1  // block began with the magic, which was zeroed
+#define JBD_FLAG_SAME_UUID 2
+#define JBD_FLAG_LAST_TAG 8
+
+#define JBD_COMPAT_CHECKSUM 1
+#define JBD_INCOMPAT_REVOKE 1
+#define JBD_INCOMPAT_64BIT 2
+#define JBD_INCOMPAT_ASYNC_COMMIT 4
+#define JBD_CRC32_CHKSUM 1
+
+struct jbd_header {
+  uint32_t magic, blocktype, sequence;
+};
+
+struct jbd_super {
+  struct jbd_header h;
+  uint32_t blocksize, maxlen, first;  // the log is blocks [first, maxlen)
+  uint32_t sequence, start;  // first transaction to replay and where, or 0
+  uint32_t error;
+  uint32_t feature_compat, feature_incompat, feature_ro_compat;
+  uint8_t uuid[16];
+};
+
+struct jbd_commit {
+  struct jbd_header h;
+  uint8_t chksum_type, chksum_size, padding[2];
+  uint32_t chksum[8];
+  uint64_t commit_sec;
+  uint32_t commit_nsec;
+};
+
+// a descriptor block is the header and then tags (8 bytes, 12 with 64-bit
+// block numbers), the first one followed by the journal's uuid
+#define TAG_FLAGS 6  // a big-endian 16-bit field
+
+struct journal {
+  MINODE *mip;     // the journal inode, held while mounted
+  uint32_t *map;   // disk block of each journal block
+  uint32_t first, maxlen;
+  uint32_t sequence;  // of the next transaction
+  int tag_bytes;
+  int max_blocks;  // most blocks one transaction can log
+  int committing;  // journal_commit is running
+  time_t committed;
+  uint8_t sb[BLKSIZE];  // the journal superblock, block 0
+};
+
+static uint32_t be32(const void *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return be32toh(v);
+}
+
+static void put_be32(void *p, uint32_t v) {
+  v = htobe32(v);
+  memcpy(p, &v, 4);
+}
+
+// the CRC32 JBD checksums transactions with: msb first, no final xor
+static uint32_t crc32_be(uint32_t crc, const uint8_t *p, size_t len) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i << 24;
+      for (int k = 0; k < 8; k++) {
+        c = c << 1 ^ (c & 0x80000000 ? 0x04c11db7 : 0);
+      }
+      table[i] = c;
+    }
+  }
+  while (len--) crc = crc << 8 ^ table[(crc >> 24) ^ *p++];
+  return crc;
+}
+
+static struct jbd_super *jsb(struct journal *j) {
+  return (struct jbd_super *)j->sb;
+}
+
+static int checksummed(struct journal *j) {
+  return be32(&jsb(j)->h.blocktype) == JBD_SUPER_V2 &&
+         (be32(&jsb(j)->feature_compat) & JBD_COMPAT_CHECKSUM);
+}
+
+// the log goes on after lbk, wrapping round to first
+static uint32_t jnext(struct journal *j, uint32_t lbk) {
+  return ++lbk < j->maxlen ? lbk : j->first;
+}
+
+static void jread(struct mntable *me, struct journal *j, uint32_t lbk,
+                  uint8_t *buf) {
+  bread_direct(me->dev, j->map[lbk], 1, buf);
+}
+
+// record where replay would start (0: nothing to replay) and with which
+// transaction
+static void write_super(struct mntable *me, struct journal *j,
+                        uint32_t start) {
+  put_be32(&jsb(j)->start, start);
+  put_be32(&jsb(j)->sequence, j->sequence);
+  bwrite_direct(me->dev, j->map[0], 1, j->sb);
+}
+
+static int tag_flags(uint8_t *tag) {
+  return tag[TAG_FLAGS] << 8 | tag[TAG_FLAGS + 1];
+}
+
+// step through the tags of a descriptor block, NULL after the last one
+static uint8_t *next_tag(struct journal *j, uint8_t *desc, uint8_t *tag) {
+  if (!tag) return desc + sizeof(struct jbd_header);
+
+  int flags = tag_flags(tag);
+  if (flags & JBD_FLAG_LAST_TAG) return NULL;
+  tag += j->tag_bytes;
+  if (!(flags & JBD_FLAG_SAME_UUID)) tag += 16;
+  return tag + j->tag_bytes <= desc + BLKSIZE ? tag : NULL;
+}
+
+// ---- replay ----
+
+struct revoke {
+  uint32_t blk, seq;  // blk is not to be replayed from seq or earlier
+};
+
+static int revoked(struct revoke *rv, int n, uint32_t blk, uint32_t seq) {
+  for (int i = 0; i < n; i++) {
+    if (rv[i].blk == blk && (int32_t)(rv[i].seq - seq) >= 0) return 1;
+  }
+  return 0;
+}
+
+// walk the log from start, as far as whole transactions with the expected
+// sequence numbers (and checksums) go. Returns the sequence after the last
+// committed one and gathers the revokes those made.
+static uint32_t scan(struct mntable *me, struct journal *j, uint32_t start,
+                     struct revoke **rv, int *nrv) {
+  uint8_t *buf = malloc(2 * BLKSIZE), *data = buf + BLKSIZE;
+  uint32_t seq = be32(&jsb(j)->sequence), lbk = start;
+  uint32_t crc = ~0u, walked = 0, limit = j->maxlen - j->first;
+  int kept = 0, cap = 0;
+
+  for (;;) {
+    if (walked++ >= limit) break;
+    jread(me, j, lbk, buf);
+    struct jbd_header *h = (struct jbd_header *)buf;
+    if (be32(&h->magic) != JBD_MAGIC || be32(&h->sequence) != seq) break;
+
+    int type = be32(&h->blocktype);
+    if (type == JBD_DESCRIPTOR) {
+      if (checksummed(j)) crc = crc32_be(crc, buf, BLKSIZE);
+      for (uint8_t *tag = NULL; (tag = next_tag(j, buf, tag));) {
+        lbk = jnext(j, lbk);
+        walked++;
+        if (checksummed(j)) {
+          jread(me, j, lbk, data);
+          crc = crc32_be(crc, data, BLKSIZE);
+        }
+      }
+    } else if (type == JBD_COMMIT) {
+      struct jbd_commit *c = (struct jbd_commit *)buf;
+      if (checksummed(j) && c->chksum_type == JBD_CRC32_CHKSUM &&
+          c->chksum_size == 4 && be32(&c->chksum[0]) != crc) {
+        break;
+      }
+      crc = ~0u;
+      seq++;
+      kept = *nrv;
+    } else if (type == JBD_REVOKE) {
+      int rec = be32(&jsb(j)->feature_incompat) & JBD_INCOMPAT_64BIT ? 8 : 4;
+      uint32_t used = be32(buf + sizeof(*h));
+      if (used > BLKSIZE) used = BLKSIZE;
+      for (uint32_t off = sizeof(*h) + 4; off + rec <= used; off += rec) {
+        if (*nrv == cap) {
+          cap = cap ? 2 * cap : 64;
+          *rv = realloc(*rv, cap * sizeof(**rv));
+        }
+        (*rv)[*nrv].blk = be32(buf + off + rec - 4);
+        (*rv)[(*nrv)++].seq = seq;
+      }
+    } else {
+      break;
+    }
+    lbk = jnext(j, lbk);
+  }
+
+  *nrv = kept;  // revokes of a transaction that never committed don't count
+  free(buf);
+  return seq;
+}
+
+// write the committed transactions in the log home, oldest first, skipping
+// revoked blocks; then empty the log and reload what was cached
+static void replay(struct mntable *me, struct journal *j) {
+  struct revoke *rv = NULL;
+  int nrv = 0;
+  uint32_t start = be32(&jsb(j)->start);
+  uint32_t seq = be32(&jsb(j)->sequence);
+  uint32_t end = scan(me, j, start, &rv, &nrv);
+  uint8_t *buf = malloc(2 * BLKSIZE), *data = buf + BLKSIZE;
+
+  for (uint32_t lbk = start; seq != end; lbk = jnext(j, lbk)) {
+    jread(me, j, lbk, buf);
+    int type = be32(&((struct jbd_header *)buf)->blocktype);
+    if (type == JBD_COMMIT) {
+      seq++;
+      jstats.replayed++;
+    } else if (type == JBD_DESCRIPTOR) {
+      for (uint8_t *tag = NULL; (tag = next_tag(j, buf, tag));) {
+        uint32_t blk = be32(tag);
+        lbk = jnext(j, lbk);
+        if (blk >= (uint32_t)me->nblocks || revoked(rv, nrv, blk, seq)) {
+          continue;
+        }
+        jread(me, j, lbk, data);
+        if (tag_flags(tag) & JBD_FLAG_ESCAPE) put_be32(data, JBD_MAGIC);
+        bwrite_direct(me->dev, blk, 1, data);
+      }
+    }
+  }
+  free(buf);
+  free(rv);
+
+  bbarrier(me->dev);
+  j->sequence = end;
+  write_super(me, j, 0);
+  bbarrier(me->dev);
+
+  alloc_release(me);
+  alloc_init(me);
+}
+
+// ---- mount and unmount ----
+
+// read and check the journal superblock and map the whole log
+static int open_journal(struct mntable *me, struct journal *j) {
+  MINODE *mip = j->mip;
+  if (mip->INODE.i_flags & EXT4_EXTENTS_FL) return 0;
+
+  int blk = bmap(mip, 0);
+  if (!blk) return 0;
+  bread_direct(me->dev, blk, 1, j->sb);
+
+  struct jbd_super *sb = jsb(j);
+  int type = be32(&sb->h.blocktype);
+  if (be32(&sb->h.magic) != JBD_MAGIC ||
+      (type != JBD_SUPER_V1 && type != JBD_SUPER_V2) ||
+      be32(&sb->blocksize) != BLKSIZE) {
+    return 0;
+  }
+  uint32_t incompat = type == JBD_SUPER_V2 ? be32(&sb->feature_incompat) : 0;
+  if (incompat & ~(JBD_INCOMPAT_REVOKE | JBD_INCOMPAT_64BIT |
+                   JBD_INCOMPAT_ASYNC_COMMIT)) {
+    return 0;
+  }
+
+  j->first = be32(&sb->first);
+  j->maxlen = be32(&sb->maxlen);
+  j->sequence = be32(&sb->sequence);
+  j->tag_bytes = incompat & JBD_INCOMPAT_64BIT ? 12 : 8;
+  if (j->first < 1 || j->first + 8 > j->maxlen ||
+      j->maxlen > file_size(&mip->INODE) / BLKSIZE) {
+    return 0;
+  }
+
+  // a descriptor and a commit block are needed besides the logged blocks
+  int per_desc = (BLKSIZE - sizeof(struct jbd_header) - 16) / j->tag_bytes;
+  j->max_blocks = (j->maxlen - j->first - 1) * per_desc / (per_desc + 1);
+
+  j->map = malloc(j->maxlen * sizeof(*j->map));
+  for (uint32_t lbk = 0; lbk < j->maxlen; lbk++) {
+    if (!(j->map[lbk] = bmap(mip, lbk))) return 0;
+  }
+  return 1;
+}
+
+static void release(struct journal *j) {
+  iput(j->mip);
+  free(j->map);
+  free(j);
+}
+
+// called once alloc_init has read the group descriptors: replays what a
+// crash left in the log, then routes metadata writes through the journal
+void journal_load(struct mntable *me) {
+  if (!(me->super.s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL)) return;
+  if (!me->super.s_journal_inum) {
+    err("external journals are not supported");
+    return;
+  }
+
+  struct journal *j = calloc(1, sizeof(*j));
+  j->mip = iget(me->dev, me->super.s_journal_inum);
+  if (!open_journal(me, j)) {
+    err("journal unusable, metadata will not be journaled");
+    release(j);
+    return;
+  }
+  if (be32(&jsb(j)->start)) replay(me, j);
+
+  // a mapped image takes writes in place, in no order the log could keep
+  if (bmapped(me->dev)) {
+    err("journal not used on a mapped image");
+    if (me->super.s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER) {
+      me->super.s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+      me->super_dirty = 1;
+    }
+    release(j);
+    return;
+  }
+
+  if (be32(&jsb(j)->h.blocktype) == JBD_SUPER_V2) {
+    put_be32(&jsb(j)->feature_compat,
+             be32(&jsb(j)->feature_compat) | JBD_COMPAT_CHECKSUM);
+    write_super(me, j, 0);
+  }
+
+  // until unmounted cleanly, fsck has to look at the log
+  uint32_t blk = 1;
+  me->super.s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+  me->super_dirty = 1;
+  super_sync(me);
+  bflush_blocks(me->dev, &blk, 1);
+  bbarrier(me->dev);
+
+  j->committed = time(0);
+  me->journal = j;
+  journal_hold(me, 1);
+}
+
+// commit what is left and stop journaling; the caller writes the superblock
+// back with needs_recovery cleared
+void journal_close(struct mntable *me) {
+  struct journal *j = me->journal;
+  if (!j) return;
+
+  journal_commit(me);
+  journal_hold(me, 0);
+  me->journal = NULL;
+  me->super.s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+  me->super_dirty = 1;
+  release(j);
+}
+
+// ---- commit ----
+
+// log bps[0..n) as transaction j->sequence: superblock, descriptors and
+// block copies go out together, then the commit block and a barrier. A
+// commit block is only known to follow whole data by its checksum; without
+// one it needs a barrier of its own in front.
+static void log_blocks(struct mntable *me, struct journal *j,
+                       struct buf **bps, int n) {
+  int per_desc = (BLKSIZE - sizeof(struct jbd_header) - 16) / j->tag_bytes;
+  int ndesc = (n + per_desc - 1) / per_desc, total = n + ndesc + 1;
+  uint8_t **pages = malloc(total * sizeof(*pages));
+  uint8_t *own = calloc(total, BLKSIZE);  // descriptors, escapes, commit
+  uint32_t crc = ~0u;
+  int p = 0;
+
+  for (int i = 0; i < n; i += per_desc) {
+    uint8_t *desc = own + (size_t)p * BLKSIZE;
+    uint8_t *tag = desc + sizeof(struct jbd_header);
+    int d = p++;
+    put_be32(desc, JBD_MAGIC);
+    put_be32(desc + 4, JBD_DESCRIPTOR);
+    put_be32(desc + 8, j->sequence);
+    pages[d] = desc;
+
+    int end = n - i < per_desc ? n : i + per_desc;
+    for (int k = i; k < end; k++) {
+      int flags = k == i ? 0 : JBD_FLAG_SAME_UUID;
+      uint8_t *data = bps[k]->data;
+      if (be32(data) == JBD_MAGIC) {
+        uint8_t *copy = own + (size_t)p * BLKSIZE;
+        memcpy(copy, data, BLKSIZE);
+        memset(copy, 0, 4);
+        data = copy;
+        flags |= JBD_FLAG_ESCAPE;
+      }
+      if (k == end - 1) flags |= JBD_FLAG_LAST_TAG;
+      pages[p++] = data;
+
+      put_be32(tag, bps[k]->blk);
+      put_be32(tag + 4, flags);
+      tag += j->tag_bytes;
+      if (k == i) {
+        memcpy(tag, jsb(j)->uuid, 16);
+        tag += 16;
+      }
+    }
+    for (int k = d; k < p; k++) crc = crc32_be(crc, pages[k], BLKSIZE);
+  }
+
+  struct jbd_commit *c = (struct jbd_commit *)(own + (size_t)p * BLKSIZE);
+  put_be32(&c->h.magic, JBD_MAGIC);
+  put_be32(&c->h.blocktype, JBD_COMMIT);
+  put_be32(&c->h.sequence, j->sequence);
+  c->chksum_type = JBD_CRC32_CHKSUM;
+  c->chksum_size = 4;
+  put_be32(&c->chksum[0], crc);
+  c->commit_sec = htobe64(time(0));
+  pages[p++] = (uint8_t *)c;
+
+  write_super(me, j, j->first);
+  int body = checksummed(j) ? total : total - 1;
+  for (int i = 0, k; i < body; i += k) {
+    uint32_t blk = j->map[j->first + i];
+    for (k = 1; i + k < body && j->map[j->first + i + k] == blk + k; k++)
+      ;
+    bwrite_pages(me->dev, blk, k, pages + i);
+  }
+  if (body < total) {
+    bbarrier(me->dev);
+    bwrite_pages(me->dev, j->map[j->first + body], 1, pages + body);
+  }
+  bbarrier(me->dev);
+
+  jstats.commits++;
+  jstats.blocks += n;
+  free(own);
+  free(pages);
+}
+
+// commit the dirty cached blocks of me as one transaction and write them
+// home before the log is reused. It must not read through the cache, since
+// it may run inside getblk.
+static void commit_dirty(struct mntable *me) {
+  static struct buf *dirty[NBUF];
+  static uint32_t blks[NBUF];
+  struct journal *j = me->journal;
+
+  int n = bdirty_bufs(me->dev, dirty);
+  if (n == 0) return;
+  assert(n <= j->max_blocks);
+  log_blocks(me, j, dirty, n);
+
+  for (int i = 0; i < n; i++) blks[i] = dirty[i]->blk;
+  if (bflush_blocks(me->dev, blks, n) < 0) {
+    // left in the log for replay; what didn't get home is dirty again and
+    // logged once more by the next commit
+    err("journal checkpoint failed");
+    return;
+  }
+  bbarrier(me->dev);
+
+  // if this is lost the transaction is just replayed again
+  j->sequence++;
+  write_super(me, j, 0);
+}
+
+// the cache commits a held dev itself, from getblk, long before its dirty
+// blocks could outgrow the log or the cache; not while that dev is already
+// committing, whose own reads and writes may land here
+static int commit_dev(int dev) {
+  struct mntable *me = dev_to_mnt_entry(dev);
+  if (me->journal->committing) return 0;
+  journal_commit(me);
+  return 1;
+}
+
+// route me's metadata writes through its journal, or stop doing so. Half
+// the cache is left for what a commit dirties itself.
+void journal_hold(struct mntable *me, int on) {
+  int limit = me->journal->max_blocks / 2;
+  bhold(me->dev, on ? commit_dev : NULL, limit < NBUF / 2 ? limit : NBUF / 2);
+}
+
+// bring me's inodes, counters and bitmaps into the cache and commit every
+// dirty block, so a transaction never holds metadata without them
+void journal_commit(struct mntable *me) {
+  struct journal *j = me->journal;
+  j->committing = 1;
+  iflush(me);
+  alloc_sync(me);
+  j->committed = time(0);
+  commit_dirty(me);
+  j->committing = 0;
+}
+
+// the commit thread: between shell commands, commit a filesystem whose
+// changes have waited JOURNAL_COMMIT_SECS or fill enough of the cache
+void journal_tick(void) {
+  time_t now = time(0);
+  for (int i = 0; i < nmounts; i++) {
+    struct mntable *me = mount_tbl[i];
+    if (me->journal && (now - me->journal->committed >= JOURNAL_COMMIT_SECS ||
+                        bdirty_count(me->dev) >= JOURNAL_MAX_DIRTY)) {
+      journal_commit(me);
+    }
+  }
+}
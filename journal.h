@@ -0,0 +1,26 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "type.h"
+
+#define JOURNAL_COMMIT_SECS 5   // longest a change waits to be committed
+#define JOURNAL_MAX_DIRTY 256   // dirty cached blocks that force a commit
+
+struct journal_stats {
+  unsigned long commits, blocks;  // transactions written, blocks logged
+  unsigned long replayed;         // transactions replayed at mount
+};
+
+extern struct journal_stats jstats;
+
+// a filesystem with an ext3 journal has its metadata go to the disk only
+// through it: the dirty cached blocks are logged as one transaction and then
+// written home, by the cache itself if they pile up between commits. Data
+// blocks are written directly.
+void journal_load(struct mntable *me);
+void journal_commit(struct mntable *me);
+void journal_hold(struct mntable *me, int on);
+void journal_tick(void);
+void journal_close(struct mntable *me);
+
+#endif
@@ -4,45 +4,72 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "aio.h"
+#include "bench.h"
+#include "dcache.h"
 #include "fileops.h"
 #include "mount.h"
 #include "fileio.h"
+#include "journal.h"
+#include "orphan.h"
 #include "util.h"
 
 void print_help(void) {
   puts("commands:\n");
   puts(
       " cd ls pwd mkdir rmdir rm creat link unlink symlink\n"
-      " readlink chmod touch open read write lseek close\n"
-      " pfd cat cp mv mount umount cs help quit\n");
+      " readlink chmod touch open read write lseek close truncate\n"
+      " pfd cat cp mv stat mount umount sync diag icache dcache bench\n"
+      " aio cs help quit\n");
   puts("open modes: 0 - read, 1 - write, 2 - rw, 3 - append\n");
+  puts("mount disk path [mmap] maps the image instead of using pread");
+  puts("aio [io_uring|threads|sync] picks how readahead and writeback run\n");
+}
+
+static void aio_cmd(char *name) {
+  enum aio_backend b;
+  if (*name) {
+    for (b = AIO_SYNC; b <= AIO_URING; b++) {
+      if (!strcmp(name, aio_backend_name(b))) break;
+    }
+    if (b > AIO_URING) {
+      err("unknown backend");
+      return;
+    }
+    if (aio_set_backend(b) == -1) {
+      err("backend not available");
+      return;
+    }
+  }
+  printf("async io: %s\n", aio_backend_name(aio_get_backend()));
 }
 
 int main(int argc, char **argv) {
   if(argc < 2) {
-    puts("usage: fs diskimage");
+    puts("usage: fs diskimage [-m]");
     return 1;
   }
 
   init();
-  mount_root(argc > 1 ? argv[1] : "diskimage");
+  mount_root(argv[1], argc > 2 && !strcmp(argv[2], "-m"));
   init_procs();
 
   printf("%sType 'help' for a list of commands%s\n", YELLOW_COL, REG_COL);
 
   char path_buf[256];
-  char line[1024], cmd[100], arg1[100], arg2[100];
+  char line[1024], cmd[100], arg1[100], arg2[100], arg3[100];
   for (;;) {
     printf("%s%s%s $ ", GREEN_COL, pwd(path_buf), REG_COL);
     memset(line, 0, sizeof(line));
     memset(cmd, 0, sizeof(cmd));
     memset(arg1, 0, sizeof(arg1));
     memset(arg2, 0, sizeof(arg2));
+    memset(arg3, 0, sizeof(arg3));
 
     fgets(line, sizeof(line), stdin);
     line[strlen(line) - 1] = 0;
 
-    sscanf(line, "%s %s %s", cmd, arg1, arg2);
+    sscanf(line, "%s %s %s %s", cmd, arg1, arg2, arg3);
 
     if (!strcmp(cmd, "help")) {
       print_help();
@@ -77,12 +104,9 @@ int main(int argc, char **argv) {
     } else if (!strcmp(cmd, "touch")) {
       loc_touch(arg1);
     } else if (!strcmp(cmd, "open")) {
-      char arg1_buf[255];
-      strcpy(arg1_buf, arg1);
-
       int fd = loc_open(arg1, (enum open_flags)atoi(arg2));
       if (fd != -1)
-        printf("opened %s with fd %d\n", arg1_buf, fd);
+        printf("opened %s with fd %d\n", arg1, fd);
       else
         printf("error: too many files open\n");
     } else if (!strcmp(cmd, "close")) {
@@ -98,23 +122,43 @@ int main(int argc, char **argv) {
     } else if (!strcmp(cmd, "write")) {
       loc_write(atoi(arg1), arg2, strlen(arg2));
     } else if (!strcmp(cmd, "lseek")) {
-      loc_lseek(atoi(arg1), atoi(arg2));
+      loc_lseek(atoi(arg1), atoll(arg2));
     } else if (!strcmp(cmd, "cat")) {
       cat(arg1);
     } else if (!strcmp(cmd, "mv")) {
       mv(arg1, arg2);
     } else if (!strcmp(cmd, "cp")) {
       cp(arg1, arg2);
+    } else if (!strcmp(cmd, "stat")) {
+      stat_file(arg1);
+    } else if (!strcmp(cmd, "truncate")) {
+      loc_truncate(arg1, strtoull(arg2, NULL, 10));
     } else if (!strcmp(cmd, "mount")) {
       if (*arg1 == '\0') {
         mount_list();
       } else {
-        mount_fs(arg1, arg2);
+        mount_fs(arg1, arg2, !strcmp(arg3, "mmap"));
       }
     } else if (!strcmp(cmd, "umount")) {
       if (umount(arg1) == -1) {
         puts("error: cannot umount");
       }
+    } else if (!strcmp(cmd, "sync")) {
+      sync_mnt_entries();
+    } else if (!strcmp(cmd, "diag")) {
+      diagnostic();
+    } else if (!strcmp(cmd, "icache")) {
+      if (*arg1 == '\0') {
+        icache_print();
+      } else {
+        set_minode_capacity(atoi(arg1));
+      }
+    } else if (!strcmp(cmd, "dcache")) {
+      dcache_print();
+    } else if (!strcmp(cmd, "bench")) {
+      bench(arg1, arg2);
+    } else if (!strcmp(cmd, "aio")) {
+      aio_cmd(arg1);
     } else if (!strcmp(cmd, "cs")) {
       if (*arg1 == '\0') {
         list_proc();
@@ -126,6 +170,12 @@ int main(int argc, char **argv) {
     } else {
         printf("%scommand \"%s\" not found%s\n", RED_COL, cmd, REG_COL);
     }
+
+    // freeing unlinked files is spread over the commands that follow
+    orphan_reclaim(ORPHAN_BATCH);
+    iflush_expired();
+    journal_tick();
+    aio_reap(0);
   }
 
   return 0;
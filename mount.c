@@ -6,45 +6,91 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "alloc.h"
+#include "cache.h"
+#include "dcache.h"
 #include "fileops.h"
+#include "journal.h"
 #include "mount.h"
+#include "orphan.h"
 #include "type.h"
 #include "util.h"
 
-#define MOUNT_TBL_SIZE 8
-struct mntable mount_tbl[MOUNT_TBL_SIZE];
+#define MOUNT_TBL_SIZE 8  // initial size, the table doubles when full
+#define NMNT_HASH 64
 
-extern MINODE minode[NMINODE];
+// mounted filesystems in mount order, mount_tbl[0] is /
+struct mntable **mount_tbl;
+int nmounts;
+static int mount_tbl_cap;
 
-int find_mnt_dev(int old_dev, int inode) {
-  if (inode == 0) {
-    return 0;
+// devs are small fds so they index dev_tbl directly; mount points are
+// hashed by the (dev, ino) of the directory they cover
+static struct mntable **dev_tbl;
+static int dev_tbl_size;
+static struct mntable *cover_hash[NMNT_HASH];
+
+static unsigned cover_bucket(int dev, int ino) {
+  return ((unsigned)dev * 2654435761u ^ (unsigned)ino) % NMNT_HASH;
+}
+
+// add an entry for dev, growing the tables as needed
+struct mntable *mnt_add(int dev) {
+  if (nmounts == mount_tbl_cap) {
+    mount_tbl_cap = mount_tbl_cap ? 2 * mount_tbl_cap : MOUNT_TBL_SIZE;
+    mount_tbl = realloc(mount_tbl, mount_tbl_cap * sizeof(*mount_tbl));
+  }
+  if (dev >= dev_tbl_size) {
+    int size = dev_tbl_size ? dev_tbl_size : MOUNT_TBL_SIZE;
+    while (size <= dev) size *= 2;
+    dev_tbl = realloc(dev_tbl, size * sizeof(*dev_tbl));
+    memset(dev_tbl + dev_tbl_size, 0,
+           (size - dev_tbl_size) * sizeof(*dev_tbl));
+    dev_tbl_size = size;
   }
 
-  for (int i = 0; i < NMINODE; i++) {
-    if (minode[i].mounted == 1 &&
-        (minode[i].mptr->mounted_inode->ino == inode) &&
-        (minode[i].mptr->dev != old_dev)) {
-      return minode[i].mptr->dev;
-    }
+  struct mntable *entry = calloc(1, sizeof(*entry));
+  entry->dev = dev;
+  mount_tbl[nmounts++] = entry;
+  dev_tbl[dev] = entry;
+  return entry;
+}
+
+static void mnt_remove(struct mntable *entry) {
+  MINODE *mip = entry->mounted_inode;
+  struct mntable **pp = &cover_hash[cover_bucket(mip->dev, mip->ino)];
+  while (*pp && *pp != entry) pp = &(*pp)->cover_next;
+  if (*pp) *pp = entry->cover_next;
+
+  int i = 0;
+  while (mount_tbl[i] != entry) i++;
+  memmove(mount_tbl + i, mount_tbl + i + 1,
+          (--nmounts - i) * sizeof(*mount_tbl));
+  dev_tbl[entry->dev] = NULL;
+  free(entry->orphans);
+  free(entry);
+}
+
+// the filesystem mounted on directory (old_dev, inode), 0 if there is none
+int find_mnt_dev(int old_dev, int inode) {
+  struct mntable *entry = cover_hash[cover_bucket(old_dev, inode)];
+  for (; entry; entry = entry->cover_next) {
+    MINODE *mip = entry->mounted_inode;
+    if (mip->ino == inode && mip->dev == old_dev) return entry->dev;
   }
   return 0;
 }
 
 void mount_list(void) {
-  struct mntable *entry = mount_tbl;
-  while (entry->dev != 0 && (entry - mount_tbl) < MOUNT_TBL_SIZE) {
-    printf("%s -> %s\n", entry->name, entry->mount_name);
-    entry++;
+  for (int i = 0; i < nmounts; i++) {
+    printf("%s -> %s%s\n", mount_tbl[i]->name, mount_tbl[i]->mount_name,
+           bmapped(mount_tbl[i]->dev) ? " (mmap)" : "");
   }
 }
 
-int mount_fs(char *disk, char *path) {
-  char path_buf[256];
-  strcpy(path_buf, path);
-
-  int dev = path_start_dev(path);
-  int ino = getino(&dev, path_buf);
+int mount_fs(char *disk, char *path, int use_mmap) {
+  int dev;
+  int ino = getino(&dev, path);
   if (ino == 0) {
     err("mount point does not exist");
     return 1;
@@ -52,108 +98,175 @@ int mount_fs(char *disk, char *path) {
   MINODE *mip = iget(dev, ino);
   if ((mip->INODE.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
     err("mount point not a directory");
+    iput(mip);
     return 1;
   }
 
-  struct mntable *search = NULL, *entry = NULL;
-  for (int i = 0; i < MOUNT_TBL_SIZE; i++) {
-    search = mount_tbl + i;
-
-    if (search->dev == 0) {
-      entry = search;
-      break;
-    } else if (strcmp(disk, search->name) == 0) {
+  if (mip->mounted) {
+    err("already a mount point");
+    iput(mip);
+    return 1;
+  }
+  if (strlen(disk) >= sizeof(mip->mptr->name) ||
+      strlen(path) >= sizeof(mip->mptr->mount_name)) {
+    err("name too long");
+    iput(mip);
+    return 1;
+  }
+  for (int i = 0; i < nmounts; i++) {
+    if (strcmp(disk, mount_tbl[i]->name) == 0) {
       err("filesystem already mounted");
+      iput(mip);
       return 1;
     }
   }
 
-  if (!entry) {
-    err("too many mounted filesystems");
-    return 1;
-  }
-
   int new_dev = open(disk, O_RDWR);
   if (new_dev == -1) {
     err("disk image does not exist");
+    iput(mip);
     return 1;
   }
+  dcache_purge_dev(new_dev);
+  if (use_mmap && bmmap(new_dev) == -1) {
+    err("cannot mmap image, using pread");
+  }
   struct ext2_super_block *super_block =
       (struct ext2_super_block *)get_block(new_dev, 1);
-  if (super_block->s_magic != EXT2_SUPER_MAGIC) {
-    err("not a valid ext2 filesystem");
+  if (super_block->s_magic != EXT2_SUPER_MAGIC ||
+      super_block->s_log_block_size != 0) {
+    if (super_block->s_magic != EXT2_SUPER_MAGIC) {
+      err("not a valid ext2 filesystem");
+    } else {
+      err("only 1 KiB block filesystems are supported");
+    }
+    binval(new_dev);
+    close(new_dev);
+    iput(mip);
     return 1;
   }
 
+  struct mntable *entry = mnt_add(new_dev);
   entry->ninodes = super_block->s_inodes_count;
   entry->nblocks = super_block->s_blocks_count;
-  entry->dev = new_dev;
   entry->mounted_inode = mip;
 
-  struct ext2_group_desc *group_desc = get_block(new_dev, 2);
-  entry->bmap = group_desc->bg_block_bitmap;
-  entry->imap = group_desc->bg_inode_bitmap;
-  entry->iblock = group_desc->bg_inode_table;
-
   strcpy(entry->mount_name, path);
   strcpy(entry->name, disk);
 
-  entry->inode_tbl_blk = group_desc->bg_inode_table;
-  entry->inode_tbl_size = entry->ninodes * sizeof(struct ext2_inode);
-
-  struct ext2_inode *inode_tbl = malloc(entry->inode_tbl_size);
-  pread(new_dev, inode_tbl, entry->inode_tbl_size,
-        entry->inode_tbl_blk * BLKSIZE);
+  alloc_init(entry);
+  journal_load(entry);
+  orphan_load(entry);
 
-  entry->inode_tbl = inode_tbl;
+  unsigned h = cover_bucket(mip->dev, mip->ino);
+  entry->cover_next = cover_hash[h];
+  cover_hash[h] = entry;
 
   mip->mounted = 1;
-  mip->parent_mount = mip->mptr->dev;  // used to traverse up out of the mount
-  mip->mptr = entry;
+  mip->parent_mount = mip->dev;  // used to traverse up out of the mount
 
   return 0;
 }
 
-void write_inode_tbl(struct mntable *entry) {
-  pwrite(entry->dev, entry->inode_tbl, entry->inode_tbl_size,
-         entry->inode_tbl_blk * BLKSIZE);
-  iput(entry->mounted_inode);
+// locate ino's on-disk record: the inode table block and the byte offset
+static uint32_t inode_loc(struct mntable *entry, int ino, uint32_t *off) {
+  uint32_t idx = (ino - 1) % entry->inodes_per_group;
+  int group = (ino - 1) / entry->inodes_per_group;
+  uint32_t per_blk = BLKSIZE / entry->inode_size;
+
+  *off = (idx % per_blk) * entry->inode_size;
+  return entry->gd[group].bg_inode_table + idx / per_blk;
+}
+
+// inode table blocks are only read when one of their inodes is first used
+void inode_read(struct mntable *entry, int ino, INODE *out) {
+  uint32_t off;
+  struct buf *bp = bread(entry->dev, inode_loc(entry, ino, &off));
+  memcpy(out, bp->data + off, sizeof(INODE));
+  brelse(bp);
+}
+
+// start reading ino's table block ahead of an inode_read
+void inode_prefetch(struct mntable *entry, int ino) {
+  uint32_t off;
+  breadahead(entry->dev, inode_loc(entry, ino, &off), 1);
+}
+
+// copy an inode into its table block, dirtying the block only on change so
+// sync writes back just the inode blocks that were modified. Returns the
+// block.
+uint32_t inode_write(struct mntable *entry, int ino, const INODE *in) {
+  uint32_t off, blk = inode_loc(entry, ino, &off);
+  struct buf *bp = bread(entry->dev, blk);
+  if (memcmp(bp->data + off, in, sizeof(INODE)) != 0) {
+    memcpy(bp->data + off, in, sizeof(INODE));
+    bdirty(bp);
+  }
+  brelse(bp);
+  return blk;
+}
+
+static void flush_mnt_entry(struct mntable *entry) {
+  journal_close(entry);
+  alloc_sync(entry);
+  if (bflush(entry->dev) < 0) err("write back failed");
   sync();
 }
 
+// write back all dirty cached blocks of every mounted filesystem
+void sync_mnt_entries(void) {
+  iput_all();
+  for (int i = 0; i < nmounts; i++) {
+    if (mount_tbl[i]->journal) {
+      journal_commit(mount_tbl[i]);
+    } else {
+      alloc_sync(mount_tbl[i]);
+      if (bflush(mount_tbl[i]->dev) < 0) err("write back failed");
+    }
+  }
+}
+
 int umount(char *path) {
-  struct mntable *entry = mount_tbl;
-  while (entry->dev != 0 && (entry - mount_tbl) < MOUNT_TBL_SIZE) {
+  for (int i = 0; i < nmounts; i++) {
+    struct mntable *entry = mount_tbl[i];
     if (strcmp(path, entry->mount_name) == 0 && !entry->busy) {
-      entry->mounted_inode->mounted = 0;
-      write_inode_tbl(entry);
+      // the journal inode is held for as long as the mount lasts
+      int skip = entry->journal ? (int)entry->super.s_journal_inum : 0;
+      if (ibusy(entry->dev, skip)) {
+        err("filesystem is busy");
+        return 1;
+      }
+
+      MINODE *mip = entry->mounted_inode;
+      mip->mounted = 0;
+      orphan_drain(entry->dev);
+      iput_all();
+      flush_mnt_entry(entry);
+      alloc_release(entry);
+      iinval(entry->dev);
+      dcache_purge_dev(entry->dev);
+      binval(entry->dev);
       close(entry->dev);
-      entry->dev = 0;
-      iput(entry->mounted_inode);
       printf("unmounted: %s\n", entry->mount_name);
+      mnt_remove(entry);
+      iput(mip);
       sync();
       return 0;
     }
-    entry++;
   }
 
   return -1;
 }
 
 struct mntable *dev_to_mnt_entry(int dev) {
-  for (int i = 0; i < MOUNT_TBL_SIZE; i++) {
-    if (mount_tbl[i].dev == dev) {
-      return &mount_tbl[i];
-    }
-  }
-  return NULL;
+  return dev >= 0 && dev < dev_tbl_size ? dev_tbl[dev] : NULL;
 }
 
 void write_mnt_entries(void) {
-  for (int i = 0; i < MOUNT_TBL_SIZE; i++) {
-    if (mount_tbl[i].dev != 0) {
-      write_inode_tbl(&mount_tbl[i]);
-      close(mount_tbl[i].dev);
-    }
+  for (int i = 0; i < nmounts; i++) {
+    flush_mnt_entry(mount_tbl[i]);
+    alloc_release(mount_tbl[i]);
+    binval(mount_tbl[i]->dev);
+    close(mount_tbl[i]->dev);
   }
 }
\ No newline at end of file
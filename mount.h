@@ -1,11 +1,18 @@
 #ifndef MOUNT_H
 #define MOUNT_H
 
+#include "type.h"
+
 void mount_list(void);
-int mount_fs(char *disk, char *path);
+int mount_fs(char *disk, char *path, int use_mmap);
 int umount(char *path);
+struct mntable *mnt_add(int dev);
 struct mntable *dev_to_mnt_entry(int dev);
+void inode_read(struct mntable *entry, int ino, INODE *out);
+void inode_prefetch(struct mntable *entry, int ino);
+uint32_t inode_write(struct mntable *entry, int ino, const INODE *in);
 void write_mnt_entries(void);
+void sync_mnt_entries(void);
 int find_mnt_dev(int old_dev, int inode);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "fileio.h"
+#include "fileops.h"
+#include "mount.h"
+#include "orphan.h"
+#include "type.h"
+#include "util.h"
+
+extern struct mntable **mount_tbl;
+extern int nmounts;
+
+struct orphan_stats ostats;
+
+// the list on disk starts at s_last_orphan and goes on through each
+// inode's i_dtime, as ext3 keeps it; me->orphans mirrors it, newest first
+
+static void list_insert(struct mntable *me, int i, uint32_t ino) {
+  if (me->norphans == me->orphans_cap) {
+    me->orphans_cap = me->orphans_cap ? 2 * me->orphans_cap : 16;
+    me->orphans = realloc(me->orphans, me->orphans_cap * sizeof(*me->orphans));
+  }
+  memmove(&me->orphans[i + 1], &me->orphans[i],
+          (me->norphans - i) * sizeof(*me->orphans));
+  me->orphans[i] = ino;
+  me->norphans++;
+}
+
+// take orphan i off the list, on disk and in memory
+static void list_remove(struct mntable *me, int i) {
+  uint32_t next = i + 1 < me->norphans ? me->orphans[i + 1] : 0;
+  if (i == 0) {
+    me->super.s_last_orphan = next;
+    me->super_dirty = 1;
+  } else {
+    MINODE *prev = iget(me->dev, me->orphans[i - 1]);
+    prev->INODE.i_dtime = next;
+    idirty(prev);
+    iput(prev);
+  }
+  memmove(&me->orphans[i], &me->orphans[i + 1],
+          (me->norphans - i - 1) * sizeof(*me->orphans));
+  me->norphans--;
+}
+
+// mip has just lost its last link; its name is gone already. The list has
+// to survive a crash from here on: with a journal the inode and superblock
+// go out in the next transaction, without one they are written now.
+void orphan_add(MINODE *mip) {
+  struct mntable *me = mip->mptr;
+  mip->INODE.i_dtime = me->super.s_last_orphan;
+  idirty(mip);
+  me->super.s_last_orphan = mip->ino;
+  me->super_dirty = 1;
+  list_insert(me, 0, mip->ino);
+  ostats.queued++;
+
+  uint32_t blks[2] = {1, inode_write(me, mip->ino, &mip->INODE)};
+  super_sync(me);
+  if (!me->journal) bflush_blocks(me->dev, blks, 2);
+}
+
+// pick up the orphans a previous run left behind; a damaged list is cut
+// where it goes wrong
+void orphan_load(struct mntable *me) {
+  uint32_t ino = me->super.s_last_orphan;
+  while (ino) {
+    if (ino < EXT2_GOOD_OLD_FIRST_INO || ino > (uint32_t)me->ninodes ||
+        me->norphans >= me->ninodes) {
+      err("bad orphan list, cutting it short");
+      if (me->norphans == 0) {
+        me->super.s_last_orphan = 0;
+        me->super_dirty = 1;
+      } else {
+        uint32_t last = me->orphans[me->norphans - 1];
+        INODE inode;
+        inode_read(me, last, &inode);
+        inode.i_dtime = 0;
+        inode_write(me, last, &inode);
+      }
+      break;
+    }
+    list_insert(me, me->norphans, ino);
+
+    INODE inode;
+    inode_read(me, ino, &inode);
+    ino = inode.i_dtime;
+  }
+}
+
+// free up to budget blocks of orphan i, cutting the file from its end, and
+// the inode itself once nothing is left. Returns the blocks freed, -1 when
+// the inode is still open and has to wait.
+static int reclaim(struct mntable *me, int i, int budget) {
+  MINODE *mip = iget(me->dev, me->orphans[i]);
+  if (mip->refCount > 1) {
+    iput(mip);
+    return -1;
+  }
+
+  // linked again (not by us), it only has to leave the list
+  if (mip->INODE.i_links_count) {
+    list_remove(me, i);
+    iput(mip);
+    return 0;
+  }
+
+  // fast symlinks have no blocks, their target is in i_block
+  int freed = 0, done = mip->INODE.i_blocks == 0;
+  while (!done && freed < budget) {
+    uint64_t size = file_size(&mip->INODE);
+    uint64_t step = (uint64_t)(budget - freed) * BLKSIZE;
+    int held = mip->INODE.i_blocks / (BLKSIZE / 512);
+    uint64_t length = held <= budget - freed || size <= step ? 0 : size - step;
+    truncat(mip, length);
+    freed += held - mip->INODE.i_blocks / (BLKSIZE / 512);
+    done = length == 0;
+  }
+
+  if (done) {
+    list_remove(me, i);
+    mip->INODE.i_dtime = time(0);
+    idirty(mip);
+    idealloc(me->dev, mip->ino);
+    ostats.reclaimed++;
+  }
+  iput(mip);
+  ostats.blocks += freed;
+  return freed;
+}
+
+// a slice of reclaim work, oldest orphans first; returns the blocks freed
+int orphan_reclaim(int budget) {
+  int freed = 0;
+  for (int m = 0; m < nmounts && freed < budget; m++) {
+    struct mntable *me = mount_tbl[m];
+    for (int i = me->norphans - 1; i >= 0 && freed < budget; i--) {
+      int n = reclaim(me, i, budget - freed);
+      if (n > 0) freed += n;
+    }
+  }
+  return freed;
+}
+
+// reclaim every orphan of dev (-1: of every filesystem) that is not open
+void orphan_drain(int dev) {
+  for (int m = 0; m < nmounts; m++) {
+    struct mntable *me = mount_tbl[m];
+    if (dev != -1 && me->dev != dev) continue;
+    for (int i = me->norphans - 1; i >= 0; i--) reclaim(me, i, INT_MAX);
+  }
+}
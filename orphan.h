@@ -0,0 +1,21 @@
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include "type.h"
+
+#define ORPHAN_BATCH 4096  // blocks reclaimed between two shell commands
+
+struct orphan_stats {
+  unsigned long queued, reclaimed, blocks;
+};
+
+extern struct orphan_stats ostats;
+
+// unlinked inodes wait on the filesystem's orphan list until their blocks
+// are freed, a budget at a time, by orphan_reclaim
+void orphan_add(MINODE *mip);
+void orphan_load(struct mntable *me);
+int orphan_reclaim(int budget);
+void orphan_drain(int dev);
+
+#endif
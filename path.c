@@ -0,0 +1,32 @@
+#include "path.h"
+
+void path_iter_start(struct path_iter *it, const char *path, size_t len) {
+  it->p = path;
+  it->end = path + len;
+  it->name = NULL;
+  it->len = 0;
+}
+
+// 1 with the next component in name/len, 0 once the path is used up
+int path_iter_next(struct path_iter *it) {
+  while (it->p < it->end && *it->p == '/') it->p++;
+  if (it->p == it->end) return 0;
+
+  it->name = it->p;
+  while (it->p < it->end && *it->p != '/') it->p++;
+  it->len = it->p - it->name;
+  return 1;
+}
+
+const char *path_base(const char *path, size_t *len, size_t *dir_len) {
+  const char *end = path;
+  while (*end) end++;
+  while (end > path && end[-1] == '/') end--;
+
+  const char *base = end;
+  while (base > path && base[-1] != '/') base--;
+
+  *len = end - base;
+  *dir_len = base - path;
+  return base;
+}
@@ -0,0 +1,21 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+// walks the components of a path in place: nothing is copied or modified,
+// runs of '/' are skipped and each component is a (name, len) slice
+struct path_iter {
+  const char *p, *end;
+  const char *name;  // current component, not NUL terminated
+  size_t len;
+};
+
+void path_iter_start(struct path_iter *it, const char *path, size_t len);
+int path_iter_next(struct path_iter *it);
+
+// the last component of path and its length, ignoring trailing slashes;
+// *dir_len is set to how much of path leads up to it
+const char *path_base(const char *path, size_t *len, size_t *dir_len);
+
+#endif
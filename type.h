@@ -2,6 +2,9 @@
 #define TYPE_H
 
 #include <ext2fs/ext2_fs.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
 typedef unsigned char u8;
 typedef unsigned short u16;
@@ -22,10 +25,13 @@ DIR *dp;
 
 #define BLKSIZE 1024
 
-#define NMINODE 100
+#define NMINODE 100  // default in-core inode cache capacity
 #define NFD 16
 #define NPROC 4
 
+#define SUPER_SYNC_SECS 30  // max age of in-core SUPER/GD counter updates
+#define INODE_SYNC_SECS 5   // how long a dirty inode may stay unwritten
+
 typedef struct minode {
   INODE INODE;
   int dev, ino;
@@ -36,13 +42,35 @@ typedef struct minode {
   int parent_mount;  // only initialized/used when mounted
 
   struct mntable *mptr;
+
+  // decoded block map, see bmap(); runs sorted by logical block
+  struct bmap_run *runs;
+  int nruns, runs_cap;
+
+  // written data for holes, not yet given blocks; sorted by logical block
+  struct dpage *dpages;
+  int ndpages, dpages_cap;
+  int dmeta;  // indirect blocks reserved for them besides their own
+
+  struct minode *hash_next;
+  struct minode *lru_prev, *lru_next;  // only linked while refCount == 0
+  struct minode *dirty_prev, *dirty_next;  // on its mount's list if dirty
 } MINODE;
 
+struct icache_stats {
+  unsigned long hits, misses, evictions;
+  unsigned long blocks_written;  // inode table blocks written by iflush
+};
+
 typedef struct oft {
   int mode;
   int refCount;
   MINODE *mptr;
-  int offset;
+  off_t offset;
+
+  // readahead: last block read, and the window most recently prefetched
+  int ra_prev;
+  int ra_start, ra_size;
 } OFT;
 
 typedef struct proc {
@@ -55,19 +83,43 @@ typedef struct proc {
   OFT *fd[NFD];
 } PROC;
 
+// in-core copy of an on-disk allocation bitmap block
+struct bitmap {
+  uint64_t *words;
+  uint32_t nbits;
+  uint32_t hint;  // no zero bit lives in a word below this one
+  uint32_t blk;
+  int dirty;
+};
+
 struct mntable {
   int ninodes;
   int nblocks;
-  int bmap;
-  int imap;
-  int iblock;
   int dev, busy;
 
-  struct minode *mounted_inode;
+  int ngroups;
+  uint32_t first_data_block;
+  uint32_t blocks_per_group, inodes_per_group;
+  uint32_t inode_size;  // on-disk inode record size, may exceed sizeof(INODE)
+
+  SUPER super;  // in-core copies, free counters are only updated here
+  GD *gd;       // all ngroups descriptors
+  int super_dirty;
+  time_t super_synced;
+  unsigned long super_writes;
 
-  struct ext2_inode *inode_tbl;
-  uint32_t inode_tbl_size;
-  uint32_t inode_tbl_blk;
+  struct bitmap *block_maps, *inode_maps;  // one per group
+  uint32_t dalloc_reserved;  // free blocks promised to delayed pages
+  uint32_t *orphans;         // unlinked inodes still to free, newest first
+  int norphans, orphans_cap;
+
+  struct minode *dirty_inodes;  // changed since written to the inode table
+  time_t inodes_synced;
+
+  struct journal *journal;  // NULL unless metadata is journaled
+
+  struct minode *mounted_inode;
+  struct mntable *cover_next;  // mount point hash chain
 
   char name[256];
   char mount_name[64];
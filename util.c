@@ -1,17 +1,25 @@
 #include "util.h"
-#include <unistd.h>
+#include "cache.h"
 
-void *get_block(int fd, uint32_t blk_num) {
-  static uint8_t blk[1024];
+#include <string.h>
 
-  pread(fd, blk, 1024, blk_num * 1024);
-  return blk;
+// unpinned: the page stays valid only until the cache recycles it, use
+// bread/brelse to hold a block across other cache activity
+void *get_block(int fd, uint32_t blk_num) {
+  struct buf *bp = bread(fd, blk_num);
+  brelse(bp);
+  return bp->data;
 }
 
 void get_block_buf(int fd, int blk_num, void *buf) {
-  pread(fd, buf, 1024, blk_num * 1024);
+  struct buf *bp = bread(fd, blk_num);
+  memcpy(buf, bp->data, BLKSIZE);
+  brelse(bp);
 }
 
 void put_block(int fd, int blk_num, char *buf) {
-  pwrite(fd, buf, 1024, blk_num * 1024);
-}
\ No newline at end of file
+  struct buf *bp = bgetblk(fd, blk_num);
+  if ((uint8_t *)buf != bp->data) memcpy(bp->data, buf, BLKSIZE);
+  bdirty(bp);
+  brelse(bp);
+}